@@ -0,0 +1,188 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+// A module compiled ahead of time, the module goes before its context.
+struct AOTModule
+{
+    unique_ptr<LLVMContext> context;
+    unique_ptr<Module> module;
+};
+
+// Compiles a whole module for the host triple ahead of time, to an object
+// file, bitcode or textual IR, and writes a C header declaring its
+// functions. The object can be linked without LLVM, the externs are
+// resolved by the linker as usual.
+class AOTCompiler
+{
+public:
+    // An empty cpu means the host cpu with all of its features, 'features'
+    // is a list like "+avx2,-fma".
+    static unique_ptr<AOTCompiler> Create(const string &cpu = "", const string &features = "")
+    {
+        static bool targetInitialized = !InitializeNativeTarget() && !InitializeNativeTargetAsmPrinter();
+        if (!targetInitialized) {
+            cout << "Failed to initialize native target" << endl;
+            return nullptr;
+        }
+
+        string triple = sys::getDefaultTargetTriple();
+        string error;
+        const Target *target = TargetRegistry::lookupTarget(triple, error);
+        if (!target) {
+            cout << "AOT error: " << error << endl;
+            return nullptr;
+        }
+
+        string cpuName = cpu;
+        string featureList = features;
+        if (cpuName.empty() || cpuName == "native") {
+            cpuName = sys::getHostCPUName().str();
+            StringMap<bool> hostFeatures;
+            if (sys::getHostCPUFeatures(hostFeatures)) {
+                string host;
+                for (auto &feature: hostFeatures) {
+                    host += (feature.second ? "+" : "-") + feature.first().str() + ",";
+                }
+                featureList = host + featureList;
+            }
+        }
+
+        TargetOptions options;
+        TargetMachine *machine = target->createTargetMachine(triple, cpuName, featureList, options,
+                                                             Reloc::PIC_, None, CodeGenOpt::Aggressive);
+        if (!machine) {
+            cout << "AOT error: cannot create a target machine for " << triple << " " << cpuName << endl;
+            return nullptr;
+        }
+        return unique_ptr<AOTCompiler>(new AOTCompiler(unique_ptr<TargetMachine>(machine)));
+    }
+
+    DataLayout GetDataLayout() const
+    {
+        return targetMachine->createDataLayout();
+    }
+
+    const Triple &GetTargetTriple() const
+    {
+        return targetMachine->getTargetTriple();
+    }
+
+    string GetCPU() const
+    {
+        return targetMachine->getTargetCPU().str();
+    }
+
+    bool EmitObject(Module &module, const string &path)
+    {
+        error_code ec;
+        raw_fd_ostream out(path, ec, sys::fs::OF_None);
+        if (ec) {
+            return LogError("Cannot write " + path + ": " + ec.message());
+        }
+        legacy::PassManager passes;
+        if (targetMachine->addPassesToEmitFile(passes, out, nullptr, CGFT_ObjectFile)) {
+            return LogError("The target cannot emit an object file");
+        }
+        passes.run(module);
+        out.flush();
+        return true;
+    }
+
+    bool EmitBitcode(Module &module, const string &path)
+    {
+        error_code ec;
+        raw_fd_ostream out(path, ec, sys::fs::OF_None);
+        if (ec) {
+            return LogError("Cannot write " + path + ": " + ec.message());
+        }
+        WriteBitcodeToFile(module, out);
+        return true;
+    }
+
+    bool EmitIR(Module &module, const string &path)
+    {
+        error_code ec;
+        raw_fd_ostream out(path, ec, sys::fs::OF_Text);
+        if (ec) {
+            return LogError("Cannot write " + path + ": " + ec.message());
+        }
+        module.print(out, nullptr);
+        return true;
+    }
+
+    // Wraps an object file written by EmitObject into a static library.
+    bool EmitLibrary(const string &objectPath, const string &path)
+    {
+        auto member = NewArchiveMember::getFile(objectPath, true);
+        if (!member) {
+            return LogError("Cannot read " + objectPath + ": " + toString(member.takeError()));
+        }
+        vector<NewArchiveMember> members;
+        members.push_back(move(*member));
+        if (Error err = writeArchive(path, members, true, object::Archive::K_GNU, true, false)) {
+            return LogError("Cannot write " + path + ": " + toString(move(err)));
+        }
+        return true;
+    }
+
+    // Declares every function defined in the module as double name(double, ...).
+    static bool EmitHeader(const Module &module, const string &path)
+    {
+        ofstream out(path);
+        if (!out) {
+            return LogError("Cannot write " + path);
+        }
+        out << "#pragma once\n\n";
+        out << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+        for (auto &func: module.functions()) {
+            if (func.isDeclaration() || !func.hasExternalLinkage()) {
+                continue;
+            }
+            out << "double " << func.getName().str() << "(";
+            size_t idx = 0;
+            for (auto &arg: func.args()) {
+                out << (idx++ ? ", " : "") << "double " << arg.getName().str();
+            }
+            out << (idx ? ");\n" : "void);\n");
+        }
+        out << "\n#ifdef __cplusplus\n}\n#endif\n";
+        return static_cast<bool>(out);
+    }
+
+private:
+    AOTCompiler(unique_ptr<TargetMachine> machine): targetMachine(move(machine)) {}
+
+    static bool LogError(const string &message)
+    {
+        cout << "AOT error: " << message << endl;
+        return false;
+    }
+
+    unique_ptr<TargetMachine> targetMachine;
+};
+
+};
@@ -2,11 +2,17 @@
 #include <string>
 #include <memory>
 #include <vector>
-#include "Token.h"
-#include "OperatorPrecedence.h"
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <iostream>
+#include <string_view>
 #include <exception>
-#include "Utils.h"
-#include "Lexer.h"
+#include "Arena.h"
+#include "Externs.h"
+
+#include "llvm/ADT/SmallVector.h"
 
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
@@ -38,17 +44,270 @@ namespace Perilla {
 //    string errorMsg;
 //};
     
-static LLVMContext context;
-static IRBuilder<> builder {context};
-static std::unique_ptr<Module> module = llvm::make_unique<Module>("Perilla jit", context);
-static std::map<std::string, Value *> symbolTable;
+// Every toplevel definition is compiled into a fresh module (owning its own
+// context) which is handed over to the JIT once the definition is complete.
+// The state is per thread, so that several threads can generate code into
+// modules of their own.
+static thread_local std::unique_ptr<LLVMContext> context;
+static thread_local std::unique_ptr<IRBuilder<>> builder;
+static thread_local std::unique_ptr<Module> module;
+static thread_local std::map<std::string, Value *, less<>> symbolTable;
+// argument names of all known functions, used to re-declare them in later modules
+static thread_local std::map<std::string, vector<string>, less<>> functionProtos;
+// values of the shared nodes emitted so far in the current function
+static thread_local std::unordered_map<uintptr_t, Value *> sharedValues;
+// their keys in the order they were emitted, see OpenSharedScope
+static thread_local std::vector<uintptr_t> sharedKeys;
+// what the externs of the program bind to, calls to intrinsic externs go to the intrinsic
+static thread_local const ExternRegistry *externRegistry = nullptr;
 
 Value *LogErrorV(const string &msg) {
     cout << msg << endl;
     return nullptr;
 }
+
+void InitializeModule(const DataLayout &layout)
+{
+    // a module left over from a previous run must go before its context
+    builder.reset();
+    module.reset();
+    context = std::make_unique<LLVMContext>();
+    module = std::make_unique<Module>("Perilla jit", *context);
+    module->setDataLayout(layout);
+    builder = std::make_unique<IRBuilder<>>(*context);
+}
+
+// Declares the function double name(double, ...) in the current module, and
+// remembers it so that later modules can call it.
+Function *DeclareFunction(string_view name, vector<string> args)
+{
+    // Make the function type double(double, double)
+    vector<Type*> doubles(args.size(), Type::getDoubleTy(*context));
+    
+    FunctionType *ft = FunctionType::get(Type::getDoubleTy(*context), doubles, false);
+    Function *f = Function::Create(ft, Function::ExternalLinkage, name, module.get());
+    
+    size_t idx = 0;
+    for (auto &Arg : f->args()) {
+        Arg.setName(args[idx++]);
+    }
+    
+    functionProtos[string(name)] = move(args);
+    return f;
+}
+
+Function *GetFunction(string_view name)
+{
+    if (externRegistry) {
+        if (const IntrinsicExtern *intrinsic = externRegistry->FindIntrinsic(name)) {
+            return Intrinsic::getDeclaration(module.get(), intrinsic->id, {Type::getDoubleTy(*context)});
+        }
+    }
+    
+    // the function may be declared or defined in the current module already
+    if (Function *func = module->getFunction(name)) {
+        return func;
+    }
+    
+    // otherwise it lives in a module owned by the JIT, re-declare it here
+    auto iter = functionProtos.find(name);
+    if (iter != functionProtos.end()) {
+        return DeclareFunction(name, iter->second);
+    }
+    return nullptr;
+}
+
+Value *EmitBinary(char op, Value *lhs, Value *rhs)
+{
+    switch (op)
+    {
+        case '+':
+            return builder->CreateFAdd(lhs, rhs, "addtmp");
+        case '-':
+            return builder->CreateFSub(lhs, rhs, "subtmp");
+        case '*':
+            return builder->CreateFMul(lhs, rhs, "multmp");
+        case '<':
+            lhs = builder->CreateFCmpULT(lhs, rhs, "cmptmp");
+            // convert bool 0/1 to double 0.0/1.0
+            return builder->CreateUIToFP(lhs, Type::getDoubleTy(*context), "booltmp");
+        default:
+            return LogErrorV("Invalid binary operator");
+    }
+}
+
+// The values of a function with inferred types are i64 for exact integers
+// and i1 for comparisons, see TypeInference, the others are doubles.
+Value *ToDouble(Value *value)
+{
+    if (value->getType()->isIntegerTy(1)) {
+        return builder->CreateUIToFP(value, Type::getDoubleTy(*context), "booltmp");
+    } else if (value->getType()->isIntegerTy()) {
+        return builder->CreateSIToFP(value, Type::getDoubleTy(*context), "inttmp");
+    }
+    return value;
+}
+
+Value *ToInt(Value *value)
+{
+    if (value->getType()->isIntegerTy(1)) {
+        return builder->CreateZExt(value, Type::getInt64Ty(*context), "booltmp");
+    }
+    return value;
+}
+
+// 'exact' when the inference proved the result an integer that a double
+// holds exactly, so the integer operation gives the same value.
+Value *EmitTypedBinary(char op, bool exact, Value *lhs, Value *rhs)
+{
+    bool integers = lhs->getType()->isIntegerTy() && rhs->getType()->isIntegerTy();
+    if (op == '<') {
+        // no NaN among the integers, slt is ult
+        if (integers) {
+            return builder->CreateICmpSLT(ToInt(lhs), ToInt(rhs), "cmptmp");
+        }
+        return builder->CreateFCmpULT(ToDouble(lhs), ToDouble(rhs), "cmptmp");
+    }
+    if (exact && integers) {
+        lhs = ToInt(lhs);
+        rhs = ToInt(rhs);
+        switch (op) {
+            case '+':
+                return builder->CreateNSWAdd(lhs, rhs, "addtmp");
+            case '-':
+                return builder->CreateNSWSub(lhs, rhs, "subtmp");
+            case '*':
+                return builder->CreateNSWMul(lhs, rhs, "multmp");
+        }
+    }
+    return EmitBinary(op, ToDouble(lhs), ToDouble(rhs));
+}
+
+// A value tested by a branch, i1 is used as it is.
+Value *ToCondition(Value *value)
+{
+    if (value->getType()->isIntegerTy(1)) {
+        return value;
+    } else if (value->getType()->isIntegerTy()) {
+        return builder->CreateICmpNE(value, ConstantInt::get(value->getType(), 0), "ifcond");
+    }
+    return builder->CreateFCmpONE(value, ConstantFP::get(*context, APFloat(0.0)), "ifcond");
+}
+
+// A shared value may only be reused where it dominates the use, so the
+// arms of an if and the body of a loop are scopes: the values emitted in
+// a scope are forgotten when it closes.
+void RememberShared(uintptr_t key, Value *value)
+{
+    sharedValues[key] = value;
+    sharedKeys.push_back(key);
+}
+
+size_t OpenSharedScope()
+{
+    return sharedKeys.size();
+}
+
+void CloseSharedScope(size_t scope)
+{
+    for (size_t idx = scope; idx < sharedKeys.size(); ++idx) {
+        sharedValues.erase(sharedKeys[idx]);
+    }
+    sharedKeys.resize(scope);
+}
+
+// Emits a call to 'callee', emitArg(idx) generates the idx'th argument.
+template<typename ArgGen>
+Value *EmitCall(string_view callee, size_t argCount, ArgGen emitArg)
+{
+    Function *func = GetFunction(callee);
+    if (!func) {
+        return LogErrorV("Unknow function referenced");
+    }
+    
+    // argument match error
+    if (func->arg_size() != argCount) {
+        return LogErrorV("Incorrect arguments size");
+    }
+    
+    SmallVector<Value *, 8> argList;
+    for (size_t idx = 0; idx < argCount; ++idx) {
+        Value *val = emitArg(idx);
+        if (!val) {
+            return LogErrorV("Evaluating argument " + to_string(idx) + " of function " + string(callee) + " fails");
+        }
+        argList.push_back(val);
+    }
+    
+    return builder->CreateCall(func, argList, "calltmp");
+}
+
+// Emits the body of a declared function, emitBody generates the return value.
+template<typename BodyGen>
+Function *EmitFunction(Function *func, BodyGen emitBody)
+{
+    if (!func) {
+        return nullptr;
+    }
+    
+    if (!func->empty()) {
+        return (Function*)LogErrorV("Function cannot be redefined");
+    }
     
+    BasicBlock *bb = BasicBlock::Create(*context, "entry", func);
+    builder->SetInsertPoint(bb);
+    
+    symbolTable.clear();
+    sharedValues.clear();
+    sharedKeys.clear();
+    for (auto &arg: func->args()) {
+        symbolTable[string(arg.getName())] = &arg;
+    }
+    
+    if (Value *retVal = emitBody()) {
+        // conplete function
+        builder->CreateRet(retVal);
+        
+        // Validate the generated code, checking for consistency.
+        verifyFunction(*func);
+        
+        return func;
+    }
+    
+    func->eraseFromParent();
+    return (Function*)LogErrorV("Error reading body, remove function");
+}
+
+struct ExprAST;
+Value *EmitExpr(ExprAST *root);
+
+// What TypeInference found for the function being emitted: the number and
+// binary nodes whose values are exact integers, and the calls that go to a
+// clone of the callee taking integers. Comparisons are i1 whenever it's set.
+struct ExprTypes
+{
+    unordered_set<const ExprAST *> ints;
+    unordered_map<const ExprAST *, Function *> clones;
+};
+static thread_local const ExprTypes *exprTypes = nullptr;
+
+// The nodes are allocated in the Arena of the ASTGenerator and are freed
+// together with it, so they only hold views and plain pointers.
 struct ASTNode {
+    enum Kind {
+        NumberKind,
+        VariableKind,
+        BinaryKind,
+        CallKind,
+        IfKind,
+        ForKind,
+        PrototypeKind,
+        FunctionKind
+    };
+    
+    const Kind kind;
+    
+    ASTNode(Kind k): kind(k) {}
     virtual string GetString() = 0;
     virtual ~ASTNode() = default;
     
@@ -56,6 +315,11 @@ struct ASTNode {
 };
 
 struct ExprAST: ASTNode {
+    // used by several parents, see NodeTable
+    bool shared;
+    
+    ExprAST(Kind k): ASTNode(k), shared(false) {}
+    
     virtual string GetString() override
     {
         return "Expr";
@@ -67,7 +331,7 @@ struct NumberExprAST: ExprAST
 {
     double value;
     
-    NumberExprAST(double val): value(val) {}
+    NumberExprAST(double val): ExprAST(NumberKind), value(val) {}
     
     virtual string GetString() override
     {
@@ -76,38 +340,38 @@ struct NumberExprAST: ExprAST
     
     virtual Value *CodeGen() override
     {
-        return ConstantFP::get(context, APFloat(value));
+        return ConstantFP::get(*context, APFloat(value));
     }
 };
 
 struct VariableExprAST: ExprAST
 {
-    string variable;
+    string_view variable;
     
-    VariableExprAST(string var): variable(move(var)) {}
+    VariableExprAST(string_view var): ExprAST(VariableKind), variable(var) {}
     
     virtual string GetString() override
     {
-        return "Variable Expr: " + variable;
+        return "Variable Expr: " + string(variable);
     }
     
     virtual Value *CodeGen() override
     {
-        Value *v = symbolTable[variable];
-        if (!v) {
+        auto iter = symbolTable.find(variable);
+        if (iter == symbolTable.end()) {
             return LogErrorV("Unknow variable name");
         }
-        return v;
+        return iter->second;
     }
 };
     
 struct BinaryExprAST: ExprAST
 {
     char op;
-    shared_ptr<ExprAST> left, right;
+    ExprAST *left, *right;
 
-    BinaryExprAST(char ch, shared_ptr<ExprAST> lhs, shared_ptr<ExprAST> rhs)
-    :op(ch), left(lhs), right(rhs) {}
+    BinaryExprAST(char ch, ExprAST *lhs, ExprAST *rhs)
+    :ExprAST(BinaryKind), op(ch), left(lhs), right(rhs) {}
     
     virtual string GetString() override
     {
@@ -116,391 +380,380 @@ struct BinaryExprAST: ExprAST
     
     virtual Value *CodeGen() override
     {
-        Value *lhs = left->CodeGen();
-        Value *rhs = right->CodeGen();
-        
-        if (!lhs || !rhs) {
-            // TODO handle error
-            return nullptr;
-        }
-        
-        switch (op)
-        {
-            case '+':
-                return builder.CreateFAdd(lhs, rhs, "addtmp");
-            case '-':
-                return builder.CreateFSub(lhs, rhs, "subtmp");
-            case '*':
-                return builder.CreateFMul(lhs, rhs, "multmp");
-            case '<':
-                lhs = builder.CreateFCmpULT(lhs, rhs, "cmptmp");
-                // convert bool 0/1 to double 0.0/1.0
-                return builder.CreateUIToFP(lhs, Type::getDoubleTy(context), "booltmp");
-            default:
-                return LogErrorV("Invalid binary operator");
-        }
+        return EmitExpr(this);
     }
 };
 
 struct CallExprAST: ExprAST
 {
-    string callee;
-    vector<shared_ptr<ExprAST>> args;
+    string_view callee;
+    ArenaArray<ExprAST *> args;
     
-    CallExprAST(string name, vector<shared_ptr<ExprAST>> arglist)
-    : callee(move(name)), args(move(arglist)) {}
+    CallExprAST(string_view name, ArenaArray<ExprAST *> arglist)
+    : ExprAST(CallKind), callee(name), args(arglist) {}
     
     virtual string GetString() override
     {
-        return "Call Function: " + callee;
+        return "Call Function: " + string(callee);
     }
     
     virtual Value *CodeGen() override
     {
-        Function *func = module->getFunction(callee);
-        if (!func) {
-            return LogErrorV("Unknow function referenced");
-        }
-        
-        // argument match error
-        if (func->arg_size() != args.size()) {
-            return LogErrorV("Incorrect arguments size");
-        }
-        
-        vector<Value *> argList;
-        for (size_t idx = 0; idx < args.size(); ++idx) {
-            Value *val = args[idx]->CodeGen();
-            if (!val) {
-                return LogErrorV("Evaluating argument " + to_string(idx) + " of function " + callee + " fails");
-            }
-            argList.push_back(val);
-        }
-        
-        return builder.CreateCall(func, argList, "calltmp");
+        return EmitExpr(this);
     }
 };
     
-struct PrototypeAST: ASTNode
+// if cond then thenExpr else elseExpr, the condition is true when it's not 0.
+struct IfExprAST: ExprAST
 {
-    string name;
-    vector<string> args;
-    
-    PrototypeAST(string funcName, vector<string> argList)
-    :name(move(funcName)), args(move(argList)) {}
+    ExprAST *cond, *thenExpr, *elseExpr;
     
+    IfExprAST(ExprAST *c, ExprAST *t, ExprAST *e)
+    : ExprAST(IfKind), cond(c), thenExpr(t), elseExpr(e) {}
     
     virtual string GetString() override
     {
-        string buffer = "Prototype: " + name + "(";
-        for (size_t i = 0; i < args.size(); ++i) {
-            if (i != 0) buffer += " ";
-            buffer += args[i];
-        }
-        buffer += ")";
-        return buffer;
+        return "If Expr";
     }
     
-    Function *CodeGen() override
+    virtual Value *CodeGen() override
     {
-        // Make the function type double(double, double)
-        vector<Type*> doubles(args.size(), Type::getDoubleTy(context));
-        
-        FunctionType *ft = FunctionType::get(Type::getDoubleTy(context), doubles, false);
-        Function *f = Function::Create(ft, Function::ExternalLinkage, name, module.get());
-        
-        size_t idx = 0;
-        for (auto &Arg : f->args()) {
-            Arg.setName(args[idx++]);
-        }
-        
-        return f;
+        return EmitExpr(this);
     }
 };
-    
-struct FunctionAST: ASTNode
+
+// for variable = start, end, step in body
+// The body runs with the variable from start, then the variable is advanced
+// by step (1 when there is none) and the loop goes on while end, evaluated
+// with the variable before the step, is not 0. The value is always 0.
+struct ForExprAST: ExprAST
 {
-    shared_ptr<PrototypeAST> prototype;
-    shared_ptr<ExprAST> body;
+    string_view variable;
+    ExprAST *start, *end, *step, *body;
+    
+    ForExprAST(string_view var, ExprAST *s, ExprAST *e, ExprAST *st, ExprAST *b)
+    : ExprAST(ForKind), variable(var), start(s), end(e), step(st), body(b) {}
     
-    FunctionAST(shared_ptr<PrototypeAST> proto, shared_ptr<ExprAST> b)
-    :prototype(proto), body(b) {}
-
     virtual string GetString() override
     {
-        return "Function Definition: " + (prototype ? prototype->GetString() : "Anonymouse");
+        return "For Expr: " + string(variable);
     }
     
-    Function *CodeGen() override
+    virtual Value *CodeGen() override
     {
-        // First, check for an existing function from a previous 'extern' declaration.
-        Function *func = module->getFunction(prototype->name);
-        
-        if (!func) {
-            func = prototype->CodeGen();
-        }
-        
-        if (!func) {
-            return nullptr;
-        }
-        
-        if (!func->empty()) {
-            return (Function*)LogErrorV("Function cannot be redefined");
-        }
-        
-        BasicBlock *bb = BasicBlock::Create(context, "entry", func);
-        builder.SetInsertPoint(bb);
-        
-        symbolTable.clear();
-        for (auto &arg: func->args()) {
-            symbolTable[arg.getName()] = &arg;
-        }
-        
-        if (Value *retVal = body->CodeGen()) {
-            // conplete function
-            builder.CreateRet(retVal);
-            
-            // Validate the generated code, checking for consistency.
-            verifyFunction(*func);
-            
-            return func;
-        }
-        
-        func->eraseFromParent();
-        return (Function*)LogErrorV("Error reading body, remove function");
+        return EmitExpr(this);
     }
 };
-
-class ASTGenerator
-{
-public:
-    ASTGenerator(shared_ptr<Lexer> _lexer): lexer(_lexer), current(Token::EofToken) {}
-
-    void Run() {
-        GetCurrent();
-        while (current != Token::EofToken) {
-            if (current == Token{';'}) {
-                // ignore toplevel ;
-                GetCurrent(); // consume ;
-                continue;
-            }
-
-            switch (current.GetType()) {
-                case Token::Type::Def:
-                    astNodes.push_back(ParseDefinition());
-                    break;
-                case Token::Type::Extern:
-                    astNodes.push_back(ParseExtern());
-                    break;
-                default:
-                    astNodes.push_back(ParseToplevel());
-                    break;
-            }
-        }
-    }
     
-    void PrintAST() const
+// Emits an expression with an explicit stack, children from left to right
+// like the recursive CodeGen would, so that deep trees don't grow the
+// native stack. An if or a for goes through stages, one per child, and
+// keeps the blocks it branches between on a stack of its own.
+Value *EmitExpr(ExprAST *root)
+{
+    struct Frame
     {
-        for (auto& node: astNodes) {
-            cout << node->GetString() << endl;
-        }
-    }
-    
-    void CodeGen() const
+        ExprAST *node;
+        int stage;  // how many children are emitted
+    };
+    struct Branch
     {
-        for (auto &node: astNodes) {
-            node->CodeGen();
-//            if (auto *ir = node->CodeGen()) {
-//                ir->dump();
-//            }
-        }
-        module->dump();
-    }
-
-    shared_ptr<ExprAST> ParsePrimary()
+        BasicBlock *elseBlock, *mergeBlock, *thenEnd;
+        Value *thenValue;
+        size_t scope;
+    };
+    struct Loop
     {
-        assert(current != Token::EofToken);
-
-        if (current.IsNumber()) {
-            double value = current.GetNumeric();
-            GetCurrent();
-            return make_shared<NumberExprAST>(value);
-        } else if (current == Token{'('}) {
-            // '(' epxression ')'
-            GetCurrent(); // consume '('
-            auto expr = ParseExpr();
-            
-            if (current != Token{')'}) {
-                HandleError("Expecting ')'");  // continue parsing
-            } else {
-                GetCurrent();
-            }
-            return expr;
-        } else if (current.IsIdent()) {
-            // look forward to determine it's a variable or a function call
-            auto previous = current;
-            if (GetCurrent() && current == Token{'('}) {
-                // function call
-                GetCurrent();
-                auto args = ParseArguments();
-                
-                if (current != Token{')'}) {
-                    HandleError("Expecting ')'");
-                } else {
-                    GetCurrent();
-                }
-                return make_shared<CallExprAST>(previous.GetContent(), move(args));
-            }
-            return make_shared<VariableExprAST>(previous.GetContent());
+        BasicBlock *loopBlock;
+        PHINode *variable;
+        Value *outer;  // the value the loop variable hides
+        Value *next;
+        size_t scope;
+        bool failed;
+    };
+    vector<Frame> stack{{root, 0}};
+    vector<Value *> values;
+    vector<Branch> branches;
+    vector<Loop> loops;
+    auto pop = [&values]() {
+        Value *value = values.back();
+        values.pop_back();
+        return value;
+    };
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        stack.pop_back();
+        ExprAST *node = frame.node;
+        if (!node) {
+            values.push_back(nullptr);
+            continue;
         }
         
-        HandleError("Expecting an expression");
-        return nullptr;
-    }
-    
-    vector<shared_ptr<ExprAST>> ParseArguments()
-    {
-        vector<shared_ptr<ExprAST>> args;
-        // empty arguments
-        if (current == Token{')'}) {
-            return args;
-        }
-
-        while (true) {
-            args.push_back(ParseExpr());
-
-            if (current == Token{')'}) {
-                return args;
+        if (node->kind == ASTNode::BinaryKind) {
+            auto *binary = static_cast<BinaryExprAST *>(node);
+            uintptr_t key = reinterpret_cast<uintptr_t>(node);
+            if (frame.stage == 0) {
+                auto iter = node->shared ? sharedValues.find(key) : sharedValues.end();
+                if (iter != sharedValues.end()) {
+                    values.push_back(iter->second);
+                    continue;
+                }
+                stack.push_back({node, 1});
+                stack.push_back({binary->right, 0});
+                stack.push_back({binary->left, 0});
+                continue;
             }
-
-            if (current == Token{','}) {
-                GetCurrent(); // consume ','
+            Value *rhs = pop();
+            Value *lhs = pop();
+            if (!lhs || !rhs) {
+                // TODO handle error
+                values.push_back(nullptr);
+                continue;
+            }
+            Value *value = exprTypes ? EmitTypedBinary(binary->op, exprTypes->ints.count(node) != 0, lhs, rhs)
+                                     : EmitBinary(binary->op, lhs, rhs);
+            if (node->shared && value) {
+                RememberShared(key, value);
+            }
+            values.push_back(value);
+        } else if (node->kind == ASTNode::CallKind) {
+            auto *call = static_cast<CallExprAST *>(node);
+            Function *clone = nullptr;
+            if (exprTypes) {
+                auto iter = exprTypes->clones.find(node);
+                clone = iter != exprTypes->clones.end() ? iter->second : nullptr;
+            }
+            if (frame.stage == 0) {
+                // the callee is checked before any argument is emitted
+                Function *func = clone ? clone : GetFunction(call->callee);
+                if (!func || func->arg_size() != call->args.size()) {
+                    values.push_back(EmitCall(call->callee, call->args.size(), [](size_t) {
+                        return nullptr;
+                    }));
+                    continue;
+                }
+                stack.push_back({node, 1});
+                for (size_t idx = call->args.size(); idx > 0; --idx) {
+                    stack.push_back({call->args[idx - 1], 0});
+                }
+                continue;
+            }
+            size_t first = values.size() - call->args.size();
+            Value *value = nullptr;
+            if (clone) {
+                // the integer arguments of the clone are i64
+                SmallVector<Value *, 8> argList;
+                for (size_t idx = 0; idx < call->args.size() && values[first + idx]; ++idx) {
+                    Value *arg = values[first + idx];
+                    argList.push_back(clone->getArg(idx)->getType()->isIntegerTy() ? ToInt(arg) : ToDouble(arg));
+                }
+                if (argList.size() == call->args.size()) {
+                    value = builder->CreateCall(clone, argList, "calltmp");
+                } else {
+                    value = LogErrorV("Evaluating the arguments of function " + string(call->callee) + " fails");
+                }
             } else {
-                HandleError("Expecting ','");
-                return args;
+                value = EmitCall(call->callee, call->args.size(), [&values, first](size_t idx) {
+                    return values[first + idx] ? ToDouble(values[first + idx]) : nullptr;
+                });
             }
-        }
-    }
-    
-    shared_ptr<ExprAST> ParseExpr()
-    {
-        auto lhs = ParsePrimary();
-        return ParseBinRhs(0, lhs);
-    }
-    
-    shared_ptr<ExprAST> ParseBinRhs(int precedence, shared_ptr<ExprAST> lhs)
-    {
-        auto previous = current;
-        if (!previous.IsUnknown()) {
-//            HandleError("Expecting a binary operator");
-            return lhs;
-        }
-
-        if (BinaryOperatorPrecedence::Support(previous.GetChar())) {
-            int prevPrec = BinaryOperatorPrecedence::Get(previous.GetChar());
-            if (prevPrec < precedence) {
-                return lhs;
+            values.resize(first);
+            values.push_back(value);
+        } else if (node->kind == ASTNode::IfKind) {
+            auto *ifExpr = static_cast<IfExprAST *>(node);
+            Function *func = builder->GetInsertBlock()->getParent();
+            if (frame.stage == 0) {
+                stack.push_back({node, 1});
+                stack.push_back({ifExpr->cond, 0});
+            } else if (frame.stage == 1) {
+                Value *cond = pop();
+                if (!cond) {
+                    values.push_back(nullptr);
+                    continue;
+                }
+                BasicBlock *thenBlock = BasicBlock::Create(*context, "then", func);
+                BasicBlock *elseBlock = BasicBlock::Create(*context, "else");
+                BasicBlock *mergeBlock = BasicBlock::Create(*context, "ifcont");
+                builder->CreateCondBr(ToCondition(cond), thenBlock, elseBlock);
+                builder->SetInsertPoint(thenBlock);
+                branches.push_back({elseBlock, mergeBlock, nullptr, nullptr, OpenSharedScope()});
+                stack.push_back({node, 2});
+                stack.push_back({ifExpr->thenExpr, 0});
+            } else if (frame.stage == 2) {
+                Branch &branch = branches.back();
+                branch.thenValue = pop();
+                branch.thenEnd = builder->GetInsertBlock();
+                builder->CreateBr(branch.mergeBlock);
+                CloseSharedScope(branch.scope);
+                func->getBasicBlockList().push_back(branch.elseBlock);
+                builder->SetInsertPoint(branch.elseBlock);
+                stack.push_back({node, 3});
+                stack.push_back({ifExpr->elseExpr, 0});
             } else {
-                GetCurrent(); // consume binary operator
-                auto rhs = ParsePrimary();
-                if (current.IsUnknown() && BinaryOperatorPrecedence::Support(current.GetChar())) {
-                    int curPrec = BinaryOperatorPrecedence::Get(current.GetChar());
-                    if (prevPrec < curPrec) {
-                        rhs = ParseBinRhs(prevPrec + 1, rhs);
-                    }
+                Branch branch = branches.back();
+                branches.pop_back();
+                Value *thenValue = branch.thenValue;
+                Value *elseValue = pop();
+                if (thenValue && elseValue && thenValue->getType() != elseValue->getType()) {
+                    // i1 and i64 meet as i64, anything else as double
+                    bool integers = thenValue->getType()->isIntegerTy() && elseValue->getType()->isIntegerTy();
+                    auto convert = [integers](Value *value) { return integers ? ToInt(value) : ToDouble(value); };
+                    elseValue = convert(elseValue);
+                    auto elsePoint = builder->saveIP();
+                    builder->SetInsertPoint(branch.thenEnd->getTerminator());
+                    thenValue = convert(thenValue);
+                    builder->restoreIP(elsePoint);
                 }
-                lhs = make_shared<BinaryExprAST>(previous.GetChar(), lhs, rhs);
-                return ParseBinRhs(precedence, lhs);
+                BasicBlock *elseEnd = builder->GetInsertBlock();
+                builder->CreateBr(branch.mergeBlock);
+                CloseSharedScope(branch.scope);
+                func->getBasicBlockList().push_back(branch.mergeBlock);
+                builder->SetInsertPoint(branch.mergeBlock);
+                if (!thenValue || !elseValue) {
+                    values.push_back(nullptr);
+                    continue;
+                }
+                PHINode *phi = builder->CreatePHI(thenValue->getType(), 2, "iftmp");
+                phi->addIncoming(thenValue, branch.thenEnd);
+                phi->addIncoming(elseValue, elseEnd);
+                values.push_back(phi);
             }
-        } else {
-//            HandleError("Unsupported binary operator " + previous.GetContent());
-            return lhs;
-        }
-    }
-    
-    shared_ptr<PrototypeAST> ParsePrototype()
-    {
-        // id '(' id* ')'
-        assert(current.IsIdent());
-
-        auto funcToken = current;
-        GetCurrent(); // consume the function name
-        if (current != Token{'('}) {
-            HandleError("Expection '('");
-            return nullptr;
-        }
-        GetCurrent(); // consume (
-        
-        vector<string> args;
-        if (current != Token{')'}) {
-            while (true) {
-                if (!current.IsIdent()) {
-                    HandleError("Expecting an ident");
-                    break;
+        } else if (node->kind == ASTNode::ForKind) {
+            auto *forExpr = static_cast<ForExprAST *>(node);
+            Type *doubleType = Type::getDoubleTy(*context);
+            if (frame.stage == 0) {
+                stack.push_back({node, 1});
+                stack.push_back({forExpr->start, 0});
+            } else if (frame.stage == 1) {
+                Value *start = pop();
+                if (!start) {
+                    values.push_back(nullptr);
+                    continue;
+                }
+                start = ToDouble(start);
+                BasicBlock *preheader = builder->GetInsertBlock();
+                BasicBlock *loopBlock = BasicBlock::Create(*context, "loop", preheader->getParent());
+                builder->CreateBr(loopBlock);
+                builder->SetInsertPoint(loopBlock);
+                PHINode *variable = builder->CreatePHI(doubleType, 2, forExpr->variable);
+                variable->addIncoming(start, preheader);
+                auto iter = symbolTable.find(forExpr->variable);
+                Value *outer = iter != symbolTable.end() ? iter->second : nullptr;
+                symbolTable[string(forExpr->variable)] = variable;
+                loops.push_back({loopBlock, variable, outer, nullptr, OpenSharedScope(), false});
+                stack.push_back({node, 2});
+                stack.push_back({forExpr->body, 0});
+            } else if (frame.stage == 2) {
+                loops.back().failed = !pop();
+                stack.push_back({node, 3});
+                if (forExpr->step) {
+                    stack.push_back({forExpr->step, 0});
+                } else {
+                    values.push_back(ConstantFP::get(*context, APFloat(1.0)));
+                }
+            } else if (frame.stage == 3) {
+                Loop &loop = loops.back();
+                Value *step = pop();
+                if (step) {
+                    loop.next = builder->CreateFAdd(loop.variable, ToDouble(step), "nextvar");
                 }
-                args.push_back(current.GetContent());
-                GetCurrent(); //consume argument name
-                
-                if (current == Token{')'}) {
-                    GetCurrent(); // consume )
-                    break;
+                stack.push_back({node, 4});
+                stack.push_back({forExpr->end, 0});
+            } else {
+                Loop loop = loops.back();
+                loops.pop_back();
+                Value *end = pop();
+                bool failed = loop.failed || !loop.next || !end;
+                BasicBlock *loopEnd = builder->GetInsertBlock();
+                BasicBlock *afterBlock = BasicBlock::Create(*context, "afterloop", loopEnd->getParent());
+                if (failed) {
+                    builder->CreateBr(afterBlock);
+                } else {
+                    builder->CreateCondBr(ToCondition(end), loop.loopBlock, afterBlock);
+                    loop.variable->addIncoming(loop.next, loopEnd);
                 }
+                builder->SetInsertPoint(afterBlock);
+                CloseSharedScope(loop.scope);
+                if (loop.outer) {
+                    symbolTable[string(forExpr->variable)] = loop.outer;
+                } else {
+                    symbolTable.erase(string(forExpr->variable));
+                }
+                values.push_back(failed ? nullptr : Constant::getNullValue(doubleType));
             }
+        } else if (exprTypes && exprTypes->ints.count(node)) {
+            double number = static_cast<NumberExprAST *>(node)->value;
+            values.push_back(ConstantInt::get(Type::getInt64Ty(*context), static_cast<int64_t>(number), true));
         } else {
-            GetCurrent(); // consume )
+            values.push_back(node->CodeGen());
         }
-        
-        return make_shared<PrototypeAST>(funcToken.GetContent(), args);
     }
+    return values.back();
+}
+    
+struct PrototypeAST: ASTNode
+{
+    string_view name;
+    ArenaArray<string_view> args;
+    
+    PrototypeAST(string_view funcName, ArenaArray<string_view> argList)
+    :ASTNode(PrototypeKind), name(funcName), args(argList) {}
     
-    shared_ptr<FunctionAST> ParseDefinition()
-    {
-        assert(current.IsDef());
-        
-        GetCurrent(); // consume def
-        auto proto = ParsePrototype();
-        auto body = ParseExpr();
-        return make_shared<FunctionAST>(proto, body);
-    }
     
-    shared_ptr<PrototypeAST> ParseExtern()
+    virtual string GetString() override
     {
-        assert(current.IsExtern());
-        
-        GetCurrent(); // consume extern
-        return ParsePrototype();
+        string buffer = "Prototype: ";
+        buffer += name;
+        buffer += "(";
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (i != 0) buffer += " ";
+            buffer += args[i];
+        }
+        buffer += ")";
+        return buffer;
     }
     
-    shared_ptr<FunctionAST> ParseToplevel()
+    bool IsAnonymous() const
     {
-        // make a anonymouse prototype
-        // anonymouse nullary function
-        auto proto = make_shared<PrototypeAST>("__anon_expr_" + GenerateRandom(10), vector<string>());
-        return make_shared<FunctionAST>(proto, ParseExpr());
+        return name.substr(0, AnonymousPrefix.size()) == AnonymousPrefix;
     }
     
-    vector<shared_ptr<ASTNode>> GetASTNodes() const
+    Function *CodeGen() override
     {
-        return astNodes;
+        return DeclareFunction(name, vector<string>(args.begin(), args.end()));
     }
+    
+    static const string AnonymousPrefix;
+};
 
-private:
-    void HandleError(string errorMessage)
+const string PrototypeAST::AnonymousPrefix = "__anon_expr_";
+    
+struct FunctionAST: ASTNode
+{
+    PrototypeAST *prototype;
+    ExprAST *body;
+    
+    FunctionAST(PrototypeAST *proto, ExprAST *b)
+    :ASTNode(FunctionKind), prototype(proto), body(b) {}
+
+    virtual string GetString() override
     {
-        cout << errorMessage << endl;
+        return "Function Definition: " + (prototype ? prototype->GetString() : "Anonymouse");
     }
     
-    bool GetCurrent()
+    Function *CodeGen() override
     {
-        if (lexer) {
-            current = lexer->NextToken();
-            return current != Token::EofToken;
+        // First, check for an existing function from a previous 'extern' declaration.
+        Function *func = module->getFunction(prototype->name);
+        
+        if (!func) {
+            func = prototype->CodeGen();
         }
-        return false;
+        
+        return EmitFunction(func, [this]() {
+            return body->CodeGen();
+        });
     }
-    
-    shared_ptr<Lexer> lexer;
-    vector<shared_ptr<ASTNode>> astNodes;
-    Token current;
 };
 
 };
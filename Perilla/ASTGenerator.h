@@ -0,0 +1,1351 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <vector>
+#include <map>
+#include <set>
+#include <atomic>
+#include <thread>
+#include "Token.h"
+#include "OperatorPrecedence.h"
+#include "Utils.h"
+#include "Lexer.h"
+#include "JIT.h"
+#include "Optimizer.h"
+#include "Arena.h"
+#include "AST.h"
+#include "FlatAST.h"
+#include "Stats.h"
+#include "SPSCRing.h"
+#include "DiskObjectCache.h"
+#include "AOT.h"
+#include "Simplifier.h"
+#include "HashConsing.h"
+#include "Batch.h"
+#include "Tiering.h"
+#include "Purity.h"
+#include "Memoization.h"
+#include "TypeInference.h"
+
+#include "llvm/ADT/SmallVector.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+class ASTGenerator
+{
+public:
+    ASTGenerator(shared_ptr<Lexer> _lexer, OptLevel level = OptLevel::O1)
+    : lexer(_lexer), current(Token::EofToken), optimizer(level), useFlatAST(false), printIR(true), stats(nullptr),
+      lookaheadPos(0), usePipeline(false), pipelineTokens(0), pipelineDone(false), codegenThreads(1), parseThreads(1),
+      objectCache(nullptr), tierThreshold(0), memoCapacity(0),
+      inferTypes(false), cloneQueue(make_unique<CloneQueue>()), clonesEmitted(0) {}
+    
+    ~ASTGenerator()
+    {
+        if (externRegistry == &externs) {
+            externRegistry = nullptr;
+        }
+    }
+    
+    // Print and compile from the FlatAST form of the nodes. It only emits
+    // plain code: type inference doesn't apply to it, and memoized and
+    // tiered definitions are still emitted from the tree.
+    void UseFlatAST(bool flat)
+    {
+        useFlatAST = flat;
+    }
+    
+    // Dump the IR of every module to stderr when it's compiled
+    void SetPrintIR(bool print)
+    {
+        printIR = print;
+    }
+    
+    // Lex on a second thread which feeds the parser through a ring of tokens.
+    // The tokens and so the AST are the same as lexing on demand.
+    void UsePipeline(bool pipeline)
+    {
+        usePipeline = pipeline;
+    }
+    
+    // Generate the code of the definitions on 'threads' threads, each one
+    // into a module of its own, before the toplevel expressions are run in
+    // order. All the definitions and externs are known up front, so a call
+    // may also refer to a function defined further down.
+    void UseParallelCodeGen(unsigned threads)
+    {
+        codegenThreads = max(threads, 1u);
+    }
+    
+    // Record the time and counters of the phases into 'stats', which must
+    // outlive the generator. Nothing is recorded without it.
+    void SetStats(Stats *s)
+    {
+        stats = s;
+    }
+
+    // Parse the parts of the source between toplevel definitions on
+    // 'threads' threads, when the lexer has the whole source in memory.
+    void UseParallelParse(unsigned threads)
+    {
+        parseThreads = max(threads, 1u);
+    }
+
+    // Build equal pure subtrees as one node, see NodeTable.
+    void UseHashConsing(bool hashConsing)
+    {
+        nodeTable.reset(hashConsing ? new NodeTable() : nullptr);
+    }
+    
+    // Compile the definitions in tiers, see TieredCompiler: unoptimized
+    // first, at O3 on a background thread once called 'threshold' times.
+    // 0 turns it off. Definitions are then generated on this thread only
+    // and the object cache is not used.
+    void UseTiering(uint64_t threshold)
+    {
+        tierThreshold = threshold;
+    }
+    
+    const TieredCompiler *GetTiering() const
+    {
+        return tiering.get();
+    }
+    
+    // Memoize the definitions that PurityAnalysis proves pure, each in a
+    // MemoTable of 'capacity' entries. 0 turns it off. Memoized definitions
+    // are neither tiered nor cached.
+    void UseMemoization(size_t capacity)
+    {
+        memoCapacity = capacity;
+    }
+    
+    // Emit the exact integer subexpressions with integer arithmetic, and
+    // calls passing integers to clones of the callee, see TypeInference.
+    // Off by default, perilla-bench --types shows what it costs and gains.
+    // Tiered and memoized definitions are not cloned.
+    void UseTypeInference(bool infer)
+    {
+        inferTypes = infer;
+    }
+    
+    // What the externs bind to, see ExternRegistry. Host functions registered
+    // before CodeGen are linked to the externs of the same name.
+    ExternRegistry &GetExterns()
+    {
+        return externs;
+    }
+    
+    const PurityAnalysis &GetPurity() const
+    {
+        return purity;
+    }
+    
+    // The memo tables made by CodeGen, in source order.
+    vector<const MemoTable *> GetMemoTables() const
+    {
+        vector<const MemoTable *> tables;
+        for (auto &table: memoOrder) {
+            tables.push_back(table);
+        }
+        return tables;
+    }
+    
+    // Keep the machine code of the definitions in 'cache', which must outlive
+    // the generator. A definition found there is neither optimized nor
+    // compiled again.
+    void SetObjectCache(DiskObjectCache *cache)
+    {
+        objectCache = cache;
+    }
+
+    void Run() {
+        auto start = chrono::steady_clock::now();
+        double lexTime = stats ? stats->GetTime(Stats::Lex) : 0;
+        bool parallel = parseThreads > 1 && lexer && !lexer->GetSource().empty();
+        size_t first = astNodes.size();
+        if (parallel) {
+            ParseParallel(lexer->GetSource());
+        } else {
+            ParseSerial();
+        }
+        NameToplevels(first);
+        
+        if (useFlatAST) {
+            flatAST = FlatAST(astNodes);
+        }
+        
+        if (stats) {
+            double parseTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if (parallel) {
+                // the lexers run inside the workers, it's all parse time
+                stats->Add(Stats::Bytes, lexer->GetSource().size());
+            } else {
+                if (usePipeline) {
+                    // the lexer ran alongside, its time overlaps the parse time
+                    stats->Add(Stats::Tokens, pipelineTokens);
+                } else {
+                    // the lexer runs inside the parser
+                    parseTime -= stats->GetTime(Stats::Lex) - lexTime;
+                }
+                stats->Add(Stats::Bytes, lexer->GetBytesLexed());
+            }
+            stats->AddTime(Stats::Parse, parseTime);
+            if (nodeTable) {
+                stats->Add(Stats::NodesShared, nodeTable->GetSharedNodes());
+            }
+            for (auto *node: astNodes) {
+                stats->CountNodes(node);
+            }
+            stats->Max(Stats::ArenaBytes, arena.GetBytesAllocated() + lexer->GetInterner().GetBytesAllocated());
+            stats->UpdatePeakMemory();
+        }
+    }
+    
+    // Folds constants and drops exact identities in the parsed AST, between
+    // Run and CodeGen. See Simplifier.
+    void Simplify()
+    {
+        {
+            Stats::Timer timer(stats, Stats::Simplify);
+            size_t removed = simplifier.GetRemovedNodes();
+            simplifier.Run(astNodes, arena);
+            if (stats) {
+                stats->Add(Stats::NodesRemoved, simplifier.GetRemovedNodes() - removed);
+            }
+        }
+        if (useFlatAST) {
+            flatAST = FlatAST(astNodes);
+        }
+    }
+
+    const Simplifier &GetSimplifier() const
+    {
+        return simplifier;
+    }
+    
+    void PrintAST() const
+    {
+        if (useFlatAST) {
+            flatAST.Print();
+            return;
+        }
+        for (auto& node: astNodes) {
+            cout << node->GetString() << endl;
+        }
+    }
+    
+    // Compile every toplevel node with the JIT, and run the toplevel
+    // expressions in source order. Returns the values of the expressions.
+    vector<double> CodeGen()
+    {
+        vector<double> results;
+        if (!jit) {
+            // the tiered JIT also compiles from its background thread, which
+            // needs the concurrent compiler of the compile threads
+            unsigned compileThreads = codegenThreads > 1 ? codegenThreads : tierThreshold ? 1 : 0;
+            if (!(jit = PerillaJIT::Create(compileThreads, tierThreshold ? nullptr : objectCache))) {
+                return results;
+            }
+            // the prototypes of a previous JIT session are gone
+            functionProtos.clear();
+            hostFunctions.clear();
+            if (tierThreshold) {
+                tiering = make_unique<TieredCompiler>(*jit, tierThreshold, &externs);
+            }
+        }
+        
+        BindExterns();
+        for (auto &[name, host]: externs.GetHostBindings()) {
+            if (hostFunctions.insert(name).second) {
+                jit->DefineHostFunction(name, host.address);
+            }
+        }
+        if (memoCapacity) {
+            CreateMemoTables();
+        }
+        CollectCloneable(!tiering);
+        
+        vector<bool> compiled(astNodes.size(), false);
+        if (codegenThreads > 1 && !tiering) {
+            compiled = CodeGenDefinitions();
+        }
+        
+        InitializeModule(jit->GetDataLayout());
+        for (size_t idx = 0; idx < astNodes.size(); ++idx) {
+            if (compiled[idx]) {
+                continue;
+            }
+            Function *ir = nullptr;
+            bool tier0 = false;
+            {
+                Stats::Timer timer(stats, Stats::CodeGen);
+                ASTNode *node = astNodes[idx];
+                if (tiering && node->kind == ASTNode::FunctionKind &&
+                    !static_cast<FunctionAST *>(node)->prototype->IsAnonymous() && !FindMemoTable(idx)) {
+                    ir = tiering->EmitTier0(*static_cast<FunctionAST *>(node));
+                    tier0 = true;
+                } else {
+                    ir = CodeGenToplevel(idx, true);
+                }
+            }
+            if (!ir) {
+                // a clone of it would compile where calling it fails
+                DropCloneable(idx);
+                continue;
+            }
+            if (stats) {
+                stats->Add(Stats::Functions, 1);
+                stats->Add(Stats::IRInstructions, ir->getInstructionCount());
+            }
+            // tier 0 is not optimized
+            if (!tier0 && !SetCacheKey(idx, optimizer)) {
+                Stats::Timer timer(stats, Stats::Optimize);
+                optimizer.RunOnFunction(*ir);
+                optimizer.RunOnModule(*module);
+            }
+            if (printIR) {
+                module->print(errs(), nullptr);
+            }
+            
+            string name = ir->getName().str();
+            if (name.compare(0, PrototypeAST::AnonymousPrefix.size(), PrototypeAST::AnonymousPrefix) != 0) {
+                {
+                    Stats::Timer timer(stats, Stats::JIT);
+                    jit->AddModule(move(module), move(context));
+                    InitializeModule(jit->GetDataLayout());
+                }
+                // before any toplevel expression may call them
+                size_t instructions = EmitClones(jit->GetDataLayout(), optimizer, stats, [this]() {
+                    if (printIR) {
+                        module->print(errs(), nullptr);
+                    }
+                    Stats::Timer timer(stats, Stats::JIT);
+                    jit->AddModule(move(module), move(context));
+                });
+                if (stats) {
+                    stats->Add(Stats::IRInstructions, instructions);
+                }
+                continue;
+            }
+            
+            // the module of a toplevel expression is removed once it's evaluated
+            uint64_t address = 0;
+            auto tracker = jit->CreateResourceTracker();
+            {
+                Stats::Timer timer(stats, Stats::JIT);
+                jit->AddModule(move(module), move(context), tracker);
+                InitializeModule(jit->GetDataLayout());
+                address = jit->Lookup(name);
+            }
+            
+            if (address) {
+                auto *fp = reinterpret_cast<double (*)()>(address);
+                results.push_back(fp());
+            }
+            jit->Remove(tracker);
+        }
+        if (tiering) {
+            tiering->Drain();
+        }
+        if (stats) {
+            if (tiering) {
+                stats->Add(Stats::TierUps, tiering->GetTierUps() - stats->Get(Stats::TierUps));
+                stats->Add(Stats::Tier0Calls, tiering->GetCalls() - stats->Get(Stats::Tier0Calls));
+            }
+            uint64_t hits = 0, misses = 0;
+            for (auto *table: memoOrder) {
+                hits += table->GetHits();
+                misses += table->GetMisses();
+            }
+            stats->Add(Stats::MemoHits, hits - stats->Get(Stats::MemoHits));
+            stats->Add(Stats::MemoMisses, misses - stats->Get(Stats::MemoMisses));
+            stats->Add(Stats::Clones, clonesEmitted - stats->Get(Stats::Clones));
+            stats->UpdatePeakMemory();
+        }
+        return results;
+    }
+
+    // The address of a compiled function after CodeGen, 0 if there is none.
+    uint64_t LookupFunction(string_view name)
+    {
+        return jit ? jit->Lookup(string(name)) : 0;
+    }
+    
+    // Compiles the batch kernel of the definition 'name', see EmitBatchKernel,
+    // and returns its address, 0 on errors. CodeGen must have run before, so
+    // that the functions it calls are in the JIT. The loop is optimized with
+    // the full O3 pipeline whatever the level, it's only vectorized there.
+    uint64_t CompileBatch(string_view name)
+    {
+        if (!jit) {
+            HandleError("CodeGen must run before CompileBatch");
+            return 0;
+        }
+        FunctionAST *def = nullptr;
+        for (auto *node: astNodes) {
+            if (node->kind == ASTNode::FunctionKind && static_cast<FunctionAST *>(node)->prototype->name == name) {
+                def = static_cast<FunctionAST *>(node);
+            }
+        }
+        if (!def) {
+            HandleError("Unknown function " + string(name));
+            return 0;
+        }
+        
+        InitializeModule(jit->GetDataLayout());
+        {
+            Stats::Timer timer(stats, Stats::CodeGen);
+            if (!EmitBatchKernel(*def)) {
+                return 0;
+            }
+        }
+        {
+            Stats::Timer timer(stats, Stats::Optimize);
+            Optimizer vectorizer(OptLevel::O3);
+            vectorizer.RunOnModule(*module);
+        }
+        if (printIR) {
+            module->print(errs(), nullptr);
+        }
+        Stats::Timer timer(stats, Stats::JIT);
+        jit->AddModule(move(module), move(context));
+        return jit->Lookup(string(name) + "_batch");
+    }
+    
+    // Generates one module with all the definitions and externs for 'aot',
+    // optimized as a whole. The toplevel expressions are left out, there is
+    // nothing to run them at build time.
+    AOTModule CodeGenModule(const AOTCompiler &aot)
+    {
+        functionProtos.clear();
+        // all the definitions are known up front, like CodeGenDefinitions
+        for (auto *node: astNodes) {
+            PrototypeAST *proto = nullptr;
+            if (node->kind == ASTNode::PrototypeKind) {
+                proto = static_cast<PrototypeAST *>(node);
+            } else if (node->kind == ASTNode::FunctionKind) {
+                proto = static_cast<FunctionAST *>(node)->prototype;
+            }
+            if (proto && !proto->IsAnonymous()) {
+                functionProtos[string(proto->name)] = vector<string>(proto->args.begin(), proto->args.end());
+            }
+        }
+        
+        BindExterns();
+        CollectCloneable(true);
+        // the clones of the JIT are in modules of their own
+        unique_ptr<CloneQueue> jitClones = move(cloneQueue);
+        cloneQueue = make_unique<CloneQueue>();
+        InitializeModule(aot.GetDataLayout());
+        module->setTargetTriple(aot.GetTargetTriple().str());
+        for (size_t idx = 0; idx < astNodes.size(); ++idx) {
+            ASTNode *node = astNodes[idx];
+            if (node->kind == ASTNode::FunctionKind && static_cast<FunctionAST *>(node)->prototype->IsAnonymous()) {
+                continue;
+            }
+            Function *ir = nullptr;
+            {
+                Stats::Timer timer(stats, Stats::CodeGen);
+                ir = CodeGenToplevel(idx);
+            }
+            if (!ir) {
+                continue;
+            }
+            if (stats) {
+                stats->Add(Stats::Functions, 1);
+                stats->Add(Stats::IRInstructions, ir->getInstructionCount());
+            }
+            Stats::Timer timer(stats, Stats::Optimize);
+            optimizer.RunOnFunction(*ir);
+        }
+        // here the clones go into the same module, internal to it
+        CloneQueue::Request request;
+        size_t clones = 0;
+        while (cloneQueue->Take(request)) {
+            Function *ir = nullptr;
+            {
+                Stats::Timer timer(stats, Stats::CodeGen);
+                TypeInference inference(cloneable, *cloneQueue);
+                ir = inference.EmitClone(request);
+            }
+            if (!ir) {
+                continue;
+            }
+            clones++;
+            ir->setLinkage(Function::InternalLinkage);
+            if (stats) {
+                stats->Add(Stats::IRInstructions, ir->getInstructionCount());
+            }
+            Stats::Timer timer(stats, Stats::Optimize);
+            optimizer.RunOnFunction(*ir);
+        }
+        cloneQueue = move(jitClones);
+        clonesEmitted += clones;
+        if (stats) {
+            stats->Add(Stats::Clones, clones);
+        }
+        {
+            Stats::Timer timer(stats, Stats::Optimize);
+            optimizer.RunOnModule(*module);
+        }
+        if (printIR) {
+            module->print(errs(), nullptr);
+        }
+        
+        AOTModule result;
+        builder.reset();
+        result.module = move(module);
+        result.context = move(context);
+        return result;
+    }
+    
+    // Parses an expression with explicit stacks instead of recursion, so
+    // that neither long operator chains nor deeply nested parentheses and
+    // calls grow the native stack. An operator first reduces the operators
+    // on the stack that bind at least as tight (all are left associative).
+    // Parentheses and calls are frames, closed once the operand sequence
+    // inside them ends. An if or a for is a frame too, going through its
+    // keywords one operand sequence after the other.
+    ExprAST *ParseExpr()
+    {
+        size_t operandBase = operands.size();
+        size_t frameBase = frames.size();
+        bool expectOperand = true;
+        while (true) {
+            if (expectOperand) {
+                expectOperand = ParseOperand();
+                continue;
+            }
+            
+            if (current.IsUnknown() && BinaryOperatorPrecedence::Support(current.GetChar())) {
+                char op = current.GetChar();
+                int precedence = BinaryOperatorPrecedence::Get(op);
+                ReduceOperators(frameBase, precedence);
+                frames.push_back({ParseFrame::Operator, op, precedence, string_view(), 0});
+                GetCurrent(); // consume binary operator
+                expectOperand = true;
+                continue;
+            }
+            
+            // the operand sequence ends, close the innermost frame
+            ReduceOperators(frameBase, 0);
+            if (frames.size() == frameBase) {
+                break;
+            }
+            ParseFrame frame = frames.back();
+            if (frame.kind == ParseFrame::If || frame.kind == ParseFrame::For) {
+                expectOperand = ContinueControl();
+                continue;
+            }
+            if (frame.kind == ParseFrame::Call && current == Token{','}) {
+                GetCurrent(); // consume ',', the next argument follows
+                expectOperand = true;
+                continue;
+            }
+            frames.pop_back();
+            if (frame.kind == ParseFrame::Call && current != Token{')'}) {
+                HandleError("Expecting ','");
+            }
+            if (current != Token{')'}) {
+                HandleError("Expecting ')'");  // continue parsing
+            } else {
+                GetCurrent();
+            }
+            if (frame.kind == ParseFrame::Call) {
+                auto args = arena.NewArray<ExprAST *>(ArrayRef<ExprAST *>(operands).slice(frame.argStart));
+                operands.resize(frame.argStart);
+                operands.push_back(arena.New<CallExprAST>(arena.NewString(frame.callee), args));
+            }
+        }
+        
+        ExprAST *expr = operands.back();
+        operands.resize(operandBase);
+        return expr;
+    }
+    
+    PrototypeAST *ParsePrototype()
+    {
+        // id '(' id* ')'
+        assert(current.IsIdent());
+
+        auto funcToken = current;
+        GetCurrent(); // consume the function name
+        if (current != Token{'('}) {
+            HandleError("Expection '('");
+            return nullptr;
+        }
+        GetCurrent(); // consume (
+        
+        SmallVector<string_view, 8> args;
+        if (current != Token{')'}) {
+            while (true) {
+                if (!current.IsIdent()) {
+                    HandleError("Expecting an ident");
+                    break;
+                }
+                args.push_back(arena.NewString(current.GetContent()));
+                GetCurrent(); //consume argument name
+                
+                if (current == Token{')'}) {
+                    GetCurrent(); // consume )
+                    break;
+                }
+            }
+        } else {
+            GetCurrent(); // consume )
+        }
+        
+        return arena.New<PrototypeAST>(arena.NewString(funcToken.GetContent()),
+                                       arena.NewArray<string_view>(args));
+    }
+    
+    FunctionAST *ParseDefinition()
+    {
+        assert(current.IsDef());
+        
+        GetCurrent(); // consume def
+        auto proto = ParsePrototype();
+        auto body = ParseExpr();
+        return arena.New<FunctionAST>(proto, body);
+    }
+    
+    PrototypeAST *ParseExtern()
+    {
+        assert(current.IsExtern());
+        
+        GetCurrent(); // consume extern
+        return ParsePrototype();
+    }
+    
+    FunctionAST *ParseToplevel()
+    {
+        // make a anonymouse prototype
+        // anonymouse nullary function, named by NameToplevels once its index
+        // among the toplevel nodes is known
+        auto proto = arena.New<PrototypeAST>(PrototypeAST::AnonymousPrefix, ArenaArray<string_view>());
+        return arena.New<FunctionAST>(proto, ParseExpr());
+    }
+    
+    const vector<ASTNode *> &GetASTNodes() const
+    {
+        return astNodes;
+    }
+    
+    const Arena &GetArena() const
+    {
+        return arena;
+    }
+    
+    const Optimizer &GetOptimizer() const
+    {
+        return optimizer;
+    }
+
+private:
+    void ParseSerial()
+    {
+        std::thread producer;
+        if (usePipeline && lexer) {
+            ring = make_unique<SPSCRing<Token>>();
+            pipelineTokens = 0;
+            pipelineDone = false;
+            producer = std::thread(&ASTGenerator::Produce, this);
+        }
+        
+        GetCurrent();
+        while (current != Token::EofToken) {
+            if (current == Token{';'}) {
+                // ignore toplevel ;
+                GetCurrent(); // consume ;
+                continue;
+            }
+
+            switch (current.GetType()) {
+                case Token::Type::Def:
+                    astNodes.push_back(ParseDefinition());
+                    break;
+                case Token::Type::Extern:
+                    astNodes.push_back(ParseExtern());
+                    break;
+                default:
+                    astNodes.push_back(ParseToplevel());
+                    break;
+            }
+        }
+        
+        if (producer.joinable()) {
+            producer.join();
+            ring.reset();
+        }
+    }
+    
+    // Names the toplevel expressions from 'first' on by their index among
+    // the toplevel nodes, which is the same however the source was parsed.
+    // The parts of ParseParallel name theirs too, those names are replaced
+    // here once the parts are merged.
+    void NameToplevels(size_t first)
+    {
+        for (size_t idx = first; idx < astNodes.size(); ++idx) {
+            if (astNodes[idx]->kind != ASTNode::FunctionKind) {
+                continue;
+            }
+            PrototypeAST *proto = static_cast<FunctionAST *>(astNodes[idx])->prototype;
+            if (proto->IsAnonymous()) {
+                proto->name = arena.NewString(PrototypeAST::AnonymousPrefix + to_string(idx));
+            }
+        }
+    }
+    
+    // Each part is lexed and parsed by a generator of its own on a worker
+    // thread, then its nodes are appended in source order and its arena is
+    // taken over.
+    void ParseParallel(string_view source)
+    {
+        vector<string_view> parts = SplitSource(source, parseThreads);
+        vector<unique_ptr<ASTGenerator>> generators(parts.size());
+        vector<Stats> partStats(parts.size());
+        vector<std::thread> threads;
+        for (size_t idx = 0; idx < parts.size(); ++idx) {
+            threads.emplace_back([&, idx]() {
+                generators[idx] = make_unique<ASTGenerator>(make_shared<ViewLexer>(parts[idx]));
+                generators[idx]->UseHashConsing(nodeTable != nullptr);
+                if (stats) {
+                    generators[idx]->SetStats(&partStats[idx]);
+                }
+                generators[idx]->Run();
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        
+        for (size_t idx = 0; idx < parts.size(); ++idx) {
+            auto &nodes = generators[idx]->astNodes;
+            astNodes.insert(astNodes.end(), nodes.begin(), nodes.end());
+            arena.Absorb(generators[idx]->arena);
+            if (stats) {
+                stats->Add(Stats::Tokens, partStats[idx].Get(Stats::Tokens));
+                stats->Add(Stats::NodesShared, partStats[idx].Get(Stats::NodesShared));
+            }
+        }
+    }
+    
+    // Splits the source into about 'count' parts of similar size. A part
+    // only ends before a line starting with 'def' or 'extern': line breaks
+    // are never inside a token, comments end at the line break, and those
+    // keywords can only start a toplevel node.
+    static vector<string_view> SplitSource(string_view source, size_t count)
+    {
+        vector<string_view> parts;
+        const char *begin = source.data();
+        const char *end = begin + source.size();
+        const char *partBegin = begin;
+        for (size_t idx = 1; idx < count; ++idx) {
+            const char *cursor = max(partBegin, begin + source.size() * idx / count);
+            const char *split = nullptr;
+            while (!split && cursor < end) {
+                cursor = Scanner::FindLineEnd(cursor, end);
+                if (cursor == end) {
+                    break;
+                }
+                ++cursor; // the beginning of the next line
+                const char *word = cursor;
+                while (word < end && (*word == ' ' || *word == '\t')) {
+                    ++word;
+                }
+                const char *wordEnd = Scanner::SkipAlnum(word, end);
+                string_view keyword(word, wordEnd - word);
+                if (keyword == "def" || keyword == "extern") {
+                    split = cursor;
+                }
+            }
+            if (!split) {
+                break;
+            }
+            parts.emplace_back(partBegin, split - partBegin);
+            partBegin = split;
+        }
+        parts.emplace_back(partBegin, end - partBegin);
+        return parts;
+    }
+    
+    // Generates the code of the named definitions on the worker threads and
+    // hands their modules to the JIT. The externs are only registered.
+    // Returns which toplevel nodes are done.
+    vector<bool> CodeGenDefinitions()
+    {
+        vector<bool> compiled(astNodes.size(), false);
+        vector<size_t> definitions;
+        for (size_t idx = 0; idx < astNodes.size(); ++idx) {
+            ASTNode *node = astNodes[idx];
+            PrototypeAST *proto = nullptr;
+            if (node->kind == ASTNode::PrototypeKind) {
+                proto = static_cast<PrototypeAST *>(node);
+            } else if (node->kind == ASTNode::FunctionKind) {
+                proto = static_cast<FunctionAST *>(node)->prototype;
+                if (!proto || proto->IsAnonymous()) {
+                    continue;
+                }
+                definitions.push_back(idx);
+            }
+            if (proto) {
+                functionProtos[string(proto->name)] = vector<string>(proto->args.begin(), proto->args.end());
+                compiled[idx] = true;
+            }
+        }
+        
+        struct Worker
+        {
+            // one module per definition like the serial path, so that the
+            // JIT still compiles only what is looked up
+            vector<unique_ptr<Module>> modules;
+            vector<unique_ptr<LLVMContext>> contexts;
+            unique_ptr<Optimizer> optimizer;
+            size_t instructions = 0;
+            vector<size_t> failed;
+        };
+        
+        size_t count = min<size_t>(codegenThreads, max<size_t>(definitions.size(), 1));
+        vector<Worker> workers(count);
+        const DataLayout &layout = jit->GetDataLayout();
+        const auto &protos = functionProtos;
+        {
+            // the optimizer runs inside the workers, it's part of the codegen time here
+            Stats::Timer timer(stats, Stats::CodeGen);
+            vector<std::thread> threads;
+            for (size_t idx = 0; idx < count; ++idx) {
+                threads.emplace_back([&, idx]() {
+                    // the code generation state of the thread, see AST.h
+                    functionProtos = protos;
+                    externRegistry = &externs;
+                    Worker &worker = workers[idx];
+                    worker.optimizer = make_unique<Optimizer>(optimizer.GetLevel());
+                    // a contiguous range of the definitions for each worker
+                    size_t end = definitions.size() * (idx + 1) / count;
+                    for (size_t def = definitions.size() * idx / count; def < end; ++def) {
+                        InitializeModule(layout);
+                        Function *ir = CodeGenToplevel(definitions[def], true);
+                        if (!ir) {
+                            worker.failed.push_back(definitions[def]);
+                            continue;
+                        }
+                        worker.instructions += ir->getInstructionCount();
+                        if (!SetCacheKey(definitions[def], *worker.optimizer)) {
+                            worker.optimizer->RunOnFunction(*ir);
+                            worker.optimizer->RunOnModule(*module);
+                        }
+                        worker.modules.push_back(move(module));
+                        worker.contexts.push_back(move(context));
+                        worker.instructions += EmitClones(layout, *worker.optimizer, nullptr, [&worker]() {
+                            worker.modules.push_back(move(module));
+                            worker.contexts.push_back(move(context));
+                        });
+                    }
+                    builder.reset();
+                    module.reset();
+                    context.reset();
+                    symbolTable.clear();
+                    functionProtos.clear();
+                    externRegistry = nullptr;
+                });
+            }
+            for (auto &thread: threads) {
+                thread.join();
+            }
+        }
+        
+        // in source order, as the workers took contiguous ranges
+        for (auto &worker: workers) {
+            optimizer.Merge(*worker.optimizer);
+            for (size_t idx: worker.failed) {
+                DropCloneable(idx);
+            }
+            if (stats) {
+                stats->Add(Stats::Functions, worker.modules.size());
+                stats->Add(Stats::IRInstructions, worker.instructions);
+            }
+            for (size_t idx = 0; idx < worker.modules.size(); ++idx) {
+                if (printIR) {
+                    worker.modules[idx]->print(errs(), nullptr);
+                }
+                Stats::Timer timer(stats, Stats::JIT);
+                jit->AddModule(move(worker.modules[idx]), move(worker.contexts[idx]));
+            }
+        }
+        return compiled;
+    }
+    
+    // Names the current module after the cache key of the idx'th toplevel
+    // node when it's a named definition, so that the JIT looks it up in the
+    // object cache. Returns whether the object is cached already, it's held
+    // for the JIT then and the module needn't be optimized.
+    bool SetCacheKey(size_t idx, const Optimizer &opt)
+    {
+        if (!objectCache || astNodes[idx]->kind != ASTNode::FunctionKind || FindMemoTable(idx)) {
+            return false;
+        }
+        auto *func = static_cast<FunctionAST *>(astNodes[idx]);
+        if (func->prototype->IsAnonymous()) {
+            return false;
+        }
+        return SetCacheKey(*func, opt);
+    }
+    
+    // The same for the module of 'func' or of a clone of it. The clones the
+    // module defines and calls are part of the key, they depend on the other
+    // definitions of the program.
+    bool SetCacheKey(const FunctionAST &func, const Optimizer &opt)
+    {
+        if (!objectCache) {
+            return false;
+        }
+        string clones;
+        for (auto &ir: *module) {
+            if (CloneQueue::IsClone(ir)) {
+                clones += ir.getName();
+                clones += ir.isDeclaration() ? ' ' : '=';
+            }
+        }
+        string key = DiskObjectCache::Key(func, opt.GetLevel(), jit->GetTargetTriple(), externs.GetIntrinsicNames(),
+                                          clones);
+        module->setModuleIdentifier(key);
+        return objectCache->Hold(key);
+    }
+    
+    // Emits the clones queued so far, also the ones they queue in turn, each
+    // into a module of its own for the JIT that is passed on by add(). The
+    // current module is a new one afterwards if there were any. Returns the
+    // number of IR instructions of the clones. The phases are timed in
+    // 'timing' unless it's nullptr.
+    template<typename AddModule>
+    size_t EmitClones(const DataLayout &layout, Optimizer &opt, Stats *timing, AddModule add)
+    {
+        size_t instructions = 0;
+        CloneQueue::Request request;
+        if (!cloneQueue->Take(request)) {
+            return 0;
+        }
+        do {
+            Function *ir = nullptr;
+            {
+                Stats::Timer timer(timing, Stats::CodeGen);
+                InitializeModule(layout);
+                TypeInference inference(cloneable, *cloneQueue);
+                ir = inference.EmitClone(request);
+            }
+            if (!ir) {
+                continue;
+            }
+            clonesEmitted++;
+            instructions += ir->getInstructionCount();
+            if (!SetCacheKey(*request.def, opt)) {
+                Stats::Timer timer(timing, Stats::Optimize);
+                opt.RunOnFunction(*ir);
+                opt.RunOnModule(*module);
+            }
+            add();
+        } while (cloneQueue->Take(request));
+        InitializeModule(layout);
+        return instructions;
+    }
+    
+    // Binds the externs of the program, see ExternRegistry, for the code
+    // generation of this thread.
+    void BindExterns()
+    {
+        vector<pair<string_view, size_t>> declared;
+        set<string_view> defined;
+        for (auto *node: astNodes) {
+            if (node->kind == ASTNode::PrototypeKind) {
+                auto *proto = static_cast<PrototypeAST *>(node);
+                declared.emplace_back(proto->name, proto->args.size());
+            } else if (node->kind == ASTNode::FunctionKind) {
+                defined.insert(static_cast<FunctionAST *>(node)->prototype->name);
+            }
+        }
+        externs.Bind(declared, defined);
+        externRegistry = &externs;
+    }
+    
+    // Runs the purity analysis and makes the tables of the pure definitions
+    // that have none yet, before any code refers to them.
+    void CreateMemoTables()
+    {
+        purity.Run(astNodes);
+        for (auto *node: astNodes) {
+            if (node->kind != ASTNode::FunctionKind) {
+                continue;
+            }
+            PrototypeAST *proto = static_cast<FunctionAST *>(node)->prototype;
+            if (purity.IsPure(proto->name) && !memoTables.count(proto->name)) {
+                auto table = make_unique<MemoTable>(string(proto->name), proto->args.size(), memoCapacity);
+                memoOrder.push_back(table.get());
+                memoTables.emplace(string(proto->name), move(table));
+            }
+        }
+    }
+    
+    // The named definitions that TypeInference may clone, none when 'clone'
+    // is false.
+    void CollectCloneable(bool clone)
+    {
+        cloneable.clear();
+        if (!inferTypes || !clone) {
+            return;
+        }
+        for (size_t idx = 0; idx < astNodes.size(); ++idx) {
+            if (astNodes[idx]->kind != ASTNode::FunctionKind || FindMemoTable(idx)) {
+                continue;
+            }
+            auto *func = static_cast<FunctionAST *>(astNodes[idx]);
+            if (!func->prototype->IsAnonymous()) {
+                cloneable[func->prototype->name] = func;
+            }
+        }
+    }
+    
+    void DropCloneable(size_t idx)
+    {
+        if (astNodes[idx]->kind == ASTNode::FunctionKind) {
+            cloneable.erase(static_cast<FunctionAST *>(astNodes[idx])->prototype->name);
+        }
+    }
+    
+    // The memo table of the idx'th toplevel node, nullptr unless it's a
+    // memoized definition.
+    MemoTable *FindMemoTable(size_t idx) const
+    {
+        if (memoTables.empty() || astNodes[idx]->kind != ASTNode::FunctionKind) {
+            return nullptr;
+        }
+        auto iter = memoTables.find(static_cast<FunctionAST *>(astNodes[idx])->prototype->name);
+        return iter != memoTables.end() ? iter->second.get() : nullptr;
+    }
+    
+    // Generates the IR of the idx'th toplevel node. Returns the function for
+    // a definition or a toplevel expression, nullptr for prototypes. Code for
+    // the JIT may be memoized, it calls into the tables of this process.
+    Function *CodeGenToplevel(size_t idx, bool forJIT = false)
+    {
+        if (forJIT) {
+            if (MemoTable *table = FindMemoTable(idx)) {
+                return EmitMemoized(*static_cast<FunctionAST *>(astNodes[idx]), *table);
+            }
+        }
+        if (useFlatAST) {
+            FlatAST::Index node = flatAST.GetRoots()[idx];
+            Value *ir = flatAST.CodeGen(node);
+            return flatAST.GetKind(node) == ASTNode::FunctionKind ? static_cast<Function *>(ir) : nullptr;
+        }
+        
+        ASTNode *node = astNodes[idx];
+        if (inferTypes && node->kind == ASTNode::FunctionKind) {
+            TypeInference inference(cloneable, *cloneQueue);
+            return inference.Emit(*static_cast<FunctionAST *>(node));
+        }
+        Value *ir = node->CodeGen();
+        return node->kind == ASTNode::FunctionKind ? static_cast<Function *>(ir) : nullptr;
+    }
+    
+    // Parses a number or a variable onto the operand stack, or opens the
+    // frame of a parenthesis or a call. Returns whether an operand is still
+    // expected.
+    bool ParseOperand()
+    {
+        if (current.IsNumber()) {
+            double value = current.GetNumeric();
+            GetCurrent();
+            operands.push_back(NewNumber(value));
+            return false;
+        } else if (current == Token{'('}) {
+            // '(' epxression ')'
+            GetCurrent(); // consume '('
+            frames.push_back({ParseFrame::Paren, 0, 0, string_view(), 0});
+            return true;
+        } else if (current == Token::IfToken) {
+            // 'if' expression 'then' expression 'else' expression
+            GetCurrent();
+            frames.push_back({ParseFrame::If, 0, 0, string_view(), operands.size()});
+            return true;
+        } else if (current == Token::ForToken) {
+            // 'for' id '=' expression ',' expression (',' expression)? 'in' expression
+            GetCurrent();
+            if (!current.IsIdent()) {
+                HandleError("Expecting an ident after 'for'");
+                operands.push_back(nullptr);
+                return false;
+            }
+            string_view variable = arena.NewString(current.GetContent());
+            GetCurrent();
+            if (current != Token{'='}) {
+                HandleError("Expecting '=' after the loop variable");
+                operands.push_back(nullptr);
+                return false;
+            }
+            GetCurrent();
+            frames.push_back({ParseFrame::For, 0, 0, variable, operands.size()});
+            return true;
+        } else if (current.IsIdent()) {
+            // look forward to determine it's a variable or a function call
+            auto previous = current;
+            if (GetCurrent() && current == Token{'('}) {
+                // function call
+                GetCurrent();
+                if (current == Token{')'}) {
+                    // empty arguments
+                    GetCurrent();
+                    operands.push_back(arena.New<CallExprAST>(arena.NewString(previous.GetContent()),
+                                                              ArenaArray<ExprAST *>()));
+                    return false;
+                }
+                frames.push_back({ParseFrame::Call, 0, 0, previous.GetContent(), operands.size()});
+                return true;
+            }
+            operands.push_back(NewVariable(previous.GetContent()));
+            return false;
+        }
+        
+        HandleError("Expecting an expression");
+        operands.push_back(nullptr);
+        return false;
+    }
+    
+    // Called when an operand sequence inside the if or for frame on top
+    // ends, at the keyword after it. Returns whether another operand
+    // sequence follows, otherwise the node is built.
+    bool ContinueControl()
+    {
+        ParseFrame &frame = frames.back();
+        if (frame.kind == ParseFrame::If) {
+            if (frame.stage < 2) {
+                const Token &keyword = frame.stage == 0 ? Token::ThenToken : Token::ElseToken;
+                if (current != keyword) {
+                    HandleError(frame.stage == 0 ? "Expecting 'then'" : "Expecting 'else'");
+                    return AbandonControl();
+                }
+                GetCurrent();
+                frame.stage++;
+                return true;
+            }
+            ExprAST **children = &operands[frame.argStart];
+            ExprAST *node = arena.New<IfExprAST>(children[0], children[1], children[2]);
+            operands.resize(frame.argStart);
+            operands.push_back(node);
+            frames.pop_back();
+            return false;
+        }
+        
+        // stages: 0 after the start, 1 after the end, 2 after the step, 3 after the body
+        if (frame.stage == 0 || frame.stage == 1) {
+            if (current == Token{','}) {
+                if (frame.stage == 0) {
+                    // the start is outside the scope of the variable
+                    BindLoopVariable(frame.callee);
+                }
+                GetCurrent();
+                frame.stage++;
+                return true;
+            }
+            if (frame.stage == 1 && current == Token::InToken) {
+                operands.push_back(nullptr);  // no step
+                GetCurrent();
+                frame.stage = 3;
+                return true;
+            }
+            HandleError(frame.stage == 0 ? "Expecting ','" : "Expecting ',' or 'in'");
+            return AbandonControl();
+        }
+        if (frame.stage == 2) {
+            if (current != Token::InToken) {
+                HandleError("Expecting 'in'");
+                return AbandonControl();
+            }
+            GetCurrent();
+            frame.stage++;
+            return true;
+        }
+        ExprAST **children = &operands[frame.argStart];
+        ExprAST *node = arena.New<ForExprAST>(frame.callee, children[0], children[1], children[2], children[3]);
+        UnbindLoopVariable();
+        operands.resize(frame.argStart);
+        operands.push_back(node);
+        frames.pop_back();
+        return false;
+    }
+    
+    // Drops the if or for frame on top after an error, its value is nullptr.
+    bool AbandonControl()
+    {
+        ParseFrame frame = frames.back();
+        frames.pop_back();
+        if (frame.kind == ParseFrame::For && frame.stage > 0) {
+            UnbindLoopVariable();
+        }
+        operands.resize(frame.argStart);
+        operands.push_back(nullptr);
+        return false;
+    }
+    
+    void BindLoopVariable(string_view name)
+    {
+        if (nodeTable) {
+            nodeTable->Bind(name);
+        }
+    }
+    
+    void UnbindLoopVariable()
+    {
+        if (nodeTable) {
+            nodeTable->Unbind();
+        }
+    }
+    
+    // Pops the operators above 'frameBase' with at least 'precedence' into
+    // binary nodes.
+    void ReduceOperators(size_t frameBase, int precedence)
+    {
+        while (frames.size() > frameBase && frames.back().kind == ParseFrame::Operator &&
+               frames.back().precedence >= precedence) {
+            char op = frames.back().op;
+            frames.pop_back();
+            ExprAST *rhs = operands.back();
+            operands.pop_back();
+            operands.back() = NewBinary(op, operands.back(), rhs);
+        }
+    }
+    
+    ExprAST *NewNumber(double value)
+    {
+        return nodeTable ? nodeTable->Number(arena, value) : arena.New<NumberExprAST>(value);
+    }
+    
+    ExprAST *NewVariable(string_view name)
+    {
+        return nodeTable ? nodeTable->Variable(arena, name) : arena.New<VariableExprAST>(arena.NewString(name));
+    }
+    
+    ExprAST *NewBinary(char op, ExprAST *lhs, ExprAST *rhs)
+    {
+        return nodeTable ? nodeTable->Binary(arena, op, lhs, rhs) : arena.New<BinaryExprAST>(op, lhs, rhs);
+    }
+    
+    void HandleError(string errorMessage)
+    {
+        cout << errorMessage << endl;
+    }
+    
+    bool GetCurrent()
+    {
+        if (!lexer) {
+            return false;
+        }
+        if (ring) {
+            // the producer stops after the Eof token
+            if (pipelineDone) {
+                current = Token::EofToken;
+                return false;
+            }
+            ring->Pop(current);
+            pipelineDone = current == Token::EofToken;
+            return !pipelineDone;
+        }
+        if (stats) {
+            if (lookaheadPos == lookahead.size()) {
+                LexAhead();
+            }
+            current = lookahead[lookaheadPos++];
+        } else {
+            current = lexer->NextToken();
+        }
+        return current != Token::EofToken;
+    }
+    
+    // With stats the tokens are lexed in batches, timing each token would
+    // cost about as much as lexing it. The tokens are views into the source,
+    // so they stay valid while they wait. A batch ends after the Eof token.
+    void LexAhead()
+    {
+        Stats::Timer timer(stats, Stats::Lex);
+        lookahead.clear();
+        lookaheadPos = 0;
+        do {
+            lookahead.push_back(lexer->NextToken());
+        } while (lookahead.back() != Token::EofToken && lookahead.size() < LookaheadTokens);
+        stats->Add(Stats::Tokens, lookahead.size() - (lookahead.back() == Token::EofToken));
+    }
+    
+    // Runs on the producer thread in the pipelined mode, lexes the whole
+    // source into the ring. Only the lexer is touched here.
+    void Produce()
+    {
+        Stats::Timer timer(stats, Stats::Lex);
+        size_t count = 0;
+        Token token = lexer->NextToken();
+        for (; token != Token::EofToken; token = lexer->NextToken()) {
+            ring->Push(token);
+            count++;
+        }
+        ring->Push(token);
+        pipelineTokens = count;
+    }
+    
+    shared_ptr<Lexer> lexer;
+    Arena arena;  // owns all the nodes
+    vector<ASTNode *> astNodes;
+    Token current;
+    unique_ptr<PerillaJIT> jit;
+    Optimizer optimizer;
+    Simplifier simplifier;
+    unique_ptr<NodeTable> nodeTable;  // only with hash consing
+    
+    // the stacks of ParseExpr
+    struct ParseFrame
+    {
+        enum Kind {
+            Operator,
+            Paren,
+            Call,
+            If,
+            For
+        };
+        Kind kind;
+        char op;
+        int precedence;
+        string_view callee;  // or the loop variable
+        size_t argStart;  // first argument, or child of an if or for, on the operand stack
+        int stage = 0;    // keywords of an if or for passed
+    };
+    vector<ExprAST *> operands;
+    vector<ParseFrame> frames;
+    bool useFlatAST;
+    FlatAST flatAST;
+    bool printIR;
+    Stats *stats;
+    static constexpr size_t LookaheadTokens = 256;
+    vector<Token> lookahead;  // the batch of LexAhead
+    size_t lookaheadPos;
+    bool usePipeline;
+    unique_ptr<SPSCRing<Token>> ring;  // only while the pipelined Run is going
+    size_t pipelineTokens;             // written by the producer before it ends
+    bool pipelineDone;
+    unsigned codegenThreads;
+    unsigned parseThreads;
+    DiskObjectCache *objectCache;
+    uint64_t tierThreshold;
+    unique_ptr<TieredCompiler> tiering;  // before the JIT goes
+    size_t memoCapacity;
+    PurityAnalysis purity;
+    map<string, unique_ptr<MemoTable>, less<>> memoTables;  // only read by the codegen workers
+    vector<MemoTable *> memoOrder;
+    ExternRegistry externs;  // only read by the codegen workers
+    set<string, less<>> hostFunctions;  // defined in the JIT already
+    bool inferTypes;
+    TypeInference::Definitions cloneable;  // only read by the codegen workers
+    unique_ptr<CloneQueue> cloneQueue;  // shared by the codegen workers
+    atomic<size_t> clonesEmitted;
+};
+
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string_view>
+#include <memory>
+#include <vector>
+#include <new>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+namespace Perilla {
+
+// A fixed size array living in an arena.
+template<typename T>
+struct ArenaArray
+{
+    T *elements;
+    size_t count;
+
+    ArenaArray(): elements(nullptr), count(0) {}
+    ArenaArray(T *elems, size_t size): elements(elems), count(size) {}
+
+    inline size_t size() const
+    {
+        return count;
+    }
+
+    inline bool empty() const
+    {
+        return count == 0;
+    }
+
+    inline T &operator[](size_t idx) const
+    {
+        return elements[idx];
+    }
+
+    inline T *begin() const
+    {
+        return elements;
+    }
+
+    inline T *end() const
+    {
+        return elements + count;
+    }
+};
+
+// A bump allocator. Memory is handed out from large blocks and is only
+// released all at once when the arena is destroyed or reset. Destructors of
+// the objects are never run, so they must not own any other resources.
+class Arena
+{
+public:
+    Arena(size_t blockSize = DefaultBlockSize)
+    : blockSize(blockSize), current(nullptr), limit(nullptr), bytesUsed(0), bytesAllocated(0) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void *Allocate(size_t size, size_t align)
+    {
+        uintptr_t address = (reinterpret_cast<uintptr_t>(current) + align - 1) & ~(uintptr_t)(align - 1);
+        if (!current || address + size > reinterpret_cast<uintptr_t>(limit)) {
+            NewBlock(size + align);
+            address = (reinterpret_cast<uintptr_t>(current) + align - 1) & ~(uintptr_t)(align - 1);
+        }
+        current = reinterpret_cast<char *>(address + size);
+        bytesUsed += size;
+        return reinterpret_cast<void *>(address);
+    }
+
+    template<typename T, typename... Args>
+    T *New(Args&&... args)
+    {
+        return new (Allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+    }
+
+    template<typename T, typename Container>
+    ArenaArray<T> NewArray(const Container &source)
+    {
+        if (source.empty()) {
+            return ArenaArray<T>();
+        }
+        T *elements = static_cast<T *>(Allocate(sizeof(T) * source.size(), alignof(T)));
+        size_t idx = 0;
+        for (auto &element: source) {
+            new (elements + idx++) T(element);
+        }
+        return ArenaArray<T>(elements, source.size());
+    }
+
+    string_view NewString(string_view text)
+    {
+        if (text.empty()) {
+            return string_view();
+        }
+        char *dest = static_cast<char *>(Allocate(text.size(), 1));
+        memcpy(dest, text.data(), text.size());
+        return string_view(dest, text.size());
+    }
+
+    // Takes over the memory of the other arena, the objects allocated from
+    // it live as long as this arena from now on.
+    void Absorb(Arena &other)
+    {
+        for (auto &block: other.blocks) {
+            blocks.push_back(move(block));
+        }
+        bytesUsed += other.bytesUsed;
+        bytesAllocated += other.bytesAllocated;
+        other.Reset();
+    }
+
+    // Frees everything allocated from the arena at once.
+    void Reset()
+    {
+        blocks.clear();
+        current = limit = nullptr;
+        bytesUsed = bytesAllocated = 0;
+    }
+
+    size_t GetBytesUsed() const
+    {
+        return bytesUsed;
+    }
+
+    size_t GetBytesAllocated() const
+    {
+        return bytesAllocated;
+    }
+
+private:
+    static constexpr size_t DefaultBlockSize = 64 * 1024;
+
+    void NewBlock(size_t minSize)
+    {
+        size_t size = max(minSize, blockSize);
+        blocks.emplace_back(new char[size]);
+        current = blocks.back().get();
+        limit = current + size;
+        bytesAllocated += size;
+    }
+
+    size_t blockSize;
+    vector<unique_ptr<char[]>> blocks;
+    char *current;
+    char *limit;
+    size_t bytesUsed;
+    size_t bytesAllocated;
+};
+
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "AST.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+// Emits the companion kernel of a definition 'foo(x y)' into the current
+// module:
+//   void foo_batch(const double *x, const double *y, double *out, size_t n)
+// which computes out[i] = foo(x[i], y[i]) for i < n. The body is generated
+// again into an internal always-inline copy, so that after inlining the
+// loop only has the arithmetic of the body and the vectorizer can widen it.
+// 'out' must not overlap the inputs.
+Function *EmitBatchKernel(FunctionAST &def)
+{
+    PrototypeAST *proto = def.prototype;
+    string name(proto->name);
+    Type *doubleType = Type::getDoubleTy(*context);
+
+    vector<Type *> doubles(proto->args.size(), doubleType);
+    FunctionType *scalarType = FunctionType::get(doubleType, doubles, false);
+    Function *scalar = Function::Create(scalarType, Function::InternalLinkage, name + ".scalar", module.get());
+    size_t idx = 0;
+    for (auto &arg: scalar->args()) {
+        arg.setName(proto->args[idx++]);
+    }
+    scalar->addFnAttr(Attribute::AlwaysInline);
+    if (!EmitFunction(scalar, [&def]() { return def.body->CodeGen(); })) {
+        return nullptr;
+    }
+
+    Type *pointerType = PointerType::getUnqual(doubleType);
+    Type *sizeType = module->getDataLayout().getIntPtrType(*context);
+    vector<Type *> params(proto->args.size() + 1, pointerType);
+    params.push_back(sizeType);
+    FunctionType *kernelType = FunctionType::get(Type::getVoidTy(*context), params, false);
+    Function *kernel = Function::Create(kernelType, Function::ExternalLinkage, name + "_batch", module.get());
+
+    size_t argCount = proto->args.size();
+    for (size_t i = 0; i < argCount; ++i) {
+        kernel->getArg(i)->setName(proto->args[i]);
+        kernel->addParamAttr(i, Attribute::ReadOnly);
+        kernel->addParamAttr(i, Attribute::NoCapture);
+    }
+    Argument *out = kernel->getArg(argCount);
+    Argument *count = kernel->getArg(argCount + 1);
+    out->setName("out");
+    count->setName("n");
+    kernel->addParamAttr(argCount, Attribute::NoAlias);
+    kernel->addParamAttr(argCount, Attribute::NoCapture);
+
+    BasicBlock *entry = BasicBlock::Create(*context, "entry", kernel);
+    BasicBlock *loop = BasicBlock::Create(*context, "loop", kernel);
+    BasicBlock *exit = BasicBlock::Create(*context, "exit", kernel);
+
+    builder->SetInsertPoint(entry);
+    Value *zero = ConstantInt::get(sizeType, 0);
+    builder->CreateCondBr(builder->CreateICmpEQ(count, zero, "empty"), exit, loop);
+
+    builder->SetInsertPoint(loop);
+    PHINode *row = builder->CreatePHI(sizeType, 2, "i");
+    row->addIncoming(zero, entry);
+    SmallVector<Value *, 8> values;
+    for (size_t i = 0; i < argCount; ++i) {
+        Value *address = builder->CreateInBoundsGEP(doubleType, kernel->getArg(i), row);
+        values.push_back(builder->CreateLoad(doubleType, address, proto->args[i]));
+    }
+    Value *result = builder->CreateCall(scalar, values, "result");
+    builder->CreateStore(result, builder->CreateInBoundsGEP(doubleType, out, row));
+    Value *next = builder->CreateAdd(row, ConstantInt::get(sizeType, 1), "next", true, true);
+    row->addIncoming(next, loop);
+    builder->CreateCondBr(builder->CreateICmpEQ(next, count, "done"), exit, loop);
+
+    builder->SetInsertPoint(exit);
+    builder->CreateRetVoid();
+
+    verifyFunction(*kernel);
+    return kernel;
+}
+
+};
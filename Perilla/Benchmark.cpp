@@ -0,0 +1,87 @@
+#include <new>
+#include <cstdlib>
+#include "Benchmark.h"
+
+using namespace Perilla;
+
+atomic<size_t> allocationCount(0);
+
+// The global operator new is replaced in the benchmark executable only, so
+// that the benchmarks can report the allocations of the front end.
+void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    if (void *ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+#if defined(__cpp_exceptions)
+    throw bad_alloc();
+#else
+    abort();
+#endif
+}
+
+// Both deletes free through here. Where a delete is inlined, GCC pairs the
+// library's operator new with this free() and warns, although the new above
+// allocates with malloc.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static void Deallocate(void *ptr)
+{
+    free(ptr);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+void operator delete(void *ptr) noexcept
+{
+    Deallocate(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    Deallocate(ptr);
+}
+
+// Runs the whole suite without arguments, or the benchmarks named by them.
+// The checking benchmarks exit with 1 when they find a failure, --check runs
+// only their checks, without the timings.
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        Benchmark::RunSuite();
+        return 0;
+    }
+    
+    size_t failures = 0;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--suite") {
+            Benchmark::RunSuite();
+        } else if (arg == "--quick") {
+            Benchmark::RunSuite(0.1, 5);
+        } else if (arg == "--lexer") {
+            Benchmark::RunLexer();
+        } else if (arg == "--parser") {
+            failures += Benchmark::RunParser();
+        } else if (arg == "--batch") {
+            failures += Benchmark::RunBatch();
+        } else if (arg == "--numbers") {
+            failures += Benchmark::RunNumbers();
+        } else if (arg == "--types") {
+            failures += Benchmark::RunTypes();
+        } else if (arg == "--check") {
+            failures += Benchmark::RunParser();
+            failures += Benchmark::RunNumbers(1 << 20, 0);
+            failures += Benchmark::RunBatch(1 << 16, 0);
+            failures += Benchmark::RunTypes(10000, 0);
+        } else {
+            cout << "Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,801 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <functional>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <deque>
+#include "Lexer.h"
+#include "ASTGenerator.h"
+
+using namespace std;
+
+// Allocations through operator new by all threads, counted by the
+// replacement of the global operator new in Benchmark.cpp. Memory allocated
+// by LLVM with malloc is not counted.
+extern atomic<size_t> allocationCount;
+
+namespace Perilla {
+
+// The lexer as it was before it worked on chunks: one virtual call per
+// character, every token copied into its own string and queued, numbers
+// converted from that copy. Only kept as the baseline of RunLexer.
+class BaselineLexer
+{
+public:
+    struct Token
+    {
+        ::Perilla::Token::Type type;
+        string content;
+        double numericValue;
+    };
+
+    BaselineLexer(string src): source(move(src)), pos(0), valid(false), current(0) {}
+    virtual ~BaselineLexer() = default;
+
+    virtual char Next()
+    {
+        return source[pos++];
+    }
+
+    virtual bool Eof() const
+    {
+        return pos >= source.size();
+    }
+
+    Token NextToken()
+    {
+        if (!valid && !GetCurrent()) {
+            return Token{::Perilla::Token::Eof, string(), 0};
+        }
+        while (valid && tokens.empty()) {
+            Parse();
+        }
+        if (tokens.empty()) {
+            return Token{::Perilla::Token::Eof, string(), 0};
+        }
+        Token front = move(tokens.front());
+        tokens.pop_front();
+        return front;
+    }
+
+private:
+    bool GetCurrent()
+    {
+        if (Eof()) {
+            valid = false;
+            return false;
+        }
+        current = Next();
+        if (!valid) {
+            line = column = 1;
+            valid = true;
+        } else if (current == '\n') {
+            line++;
+            column = 1;
+        } else {
+            column++;
+        }
+        return true;
+    }
+
+    void Parse()
+    {
+        while (valid && isspace(static_cast<unsigned char>(current))) {
+            if (!GetCurrent()) {
+                return;
+            }
+        }
+        if (isalpha(static_cast<unsigned char>(current))) {
+            string buffer(1, current);
+            while (GetCurrent() && isalnum(static_cast<unsigned char>(current))) {
+                buffer += current;
+            }
+            auto type = buffer == "def" ? ::Perilla::Token::Def :
+                buffer == "extern" ? ::Perilla::Token::Extern : ::Perilla::Token::Ident;
+            tokens.push_back(Token{type, move(buffer), 0});
+        } else if (current == '-' || isdigit(static_cast<unsigned char>(current))) {
+            //    +   -   .  e/E  0  1-9
+            static const short transformTable[][6] = {
+                {-1,  1, -1, -1,  2,  3},
+                {-1, -1, -1, -1,  2,  3},
+                {-1, -1,  4,  5, -1, -1},
+                {-1, -1,  4,  5,  3,  3},
+                {-1, -1, -1, -1,  6,  6},
+                { 7,  7, -1, -1,  8,  8},
+                {-1, -1, -1,  5,  6,  6},
+                {-1, -1, -1, -1,  8,  8},
+                {-1, -1, -1, -1,  8,  8}
+            };
+            string buffer;
+            short state = 0;
+            while (valid && (isdigit(static_cast<unsigned char>(current)) || strchr("+-.eE", current))) {
+                int inputType = current == '+' ? 0 : current == '-' ? 1 : current == '.' ? 2 :
+                    (current == 'e' || current == 'E') ? 3 : current == '0' ? 4 : 5;
+                state = transformTable[state][inputType];
+                if (state == -1) {
+                    break;
+                }
+                buffer += current;
+                GetCurrent();
+            }
+            if (buffer == "-") {
+                tokens.push_back(Token{::Perilla::Token::Unknown, move(buffer), 0});
+            } else {
+                // stod, minus the exceptions on out of range values
+                double value = strtod(buffer.c_str(), nullptr);
+                tokens.push_back(Token{::Perilla::Token::Number, move(buffer), value});
+            }
+        } else if (current == '#') {
+            while (current != '\n' && GetCurrent()) {
+            }
+            GetCurrent();
+        } else {
+            tokens.push_back(Token{::Perilla::Token::Unknown, string(1, current), 0});
+            GetCurrent();
+        }
+    }
+
+    string source;
+    size_t pos;
+    bool valid;
+    char current;
+    size_t line;
+    size_t column;
+    deque<Token> tokens;
+};
+
+class Benchmark
+{
+public:
+    // Median and p99 of the durations of the runs, and the median of the
+    // allocations per run.
+    struct Result
+    {
+        double median;
+        double p99;
+        size_t allocations;
+    };
+
+    // A program mixing definitions, calls, numbers and comments, about
+    // 'bytes' long.
+    static string GenerateSource(size_t bytes)
+    {
+        string src;
+        src.reserve(bytes + 128);
+        size_t idx = 0;
+        while (src.size() < bytes) {
+            string name = "func" + to_string(idx++);
+            src += "# " + name + " computes a weighted sum of its arguments\n";
+            src += "def " + name + "(alpha beta gamma)\n";
+            src += "    alpha * 0.125 + beta * 3.14159e-2 - gamma * 42 + " + name + "(1, 2, 3)\n";
+            src += "\n";
+        }
+        return src;
+    }
+
+    // Mostly comments and indentation, few tokens
+    static string GenerateCommentSource(size_t bytes)
+    {
+        string src;
+        src.reserve(bytes + 256);
+        size_t idx = 0;
+        while (src.size() < bytes) {
+            src += "# generated rule " + to_string(idx++) + ", the value is clamped to the range of the table\n";
+            src += "#   which is looked up by the caller before the evaluation of this rule starts\n";
+            src += "                                                        x\n";
+        }
+        return src;
+    }
+
+    // Numeric literals in the syntax of the lexer: the shortest and the
+    // round-trip forms of random doubles, and random digit strings with
+    // long mantissas and extreme exponents.
+    static vector<string> GenerateNumbers(size_t count, unsigned seed = 42)
+    {
+        mt19937_64 random(seed);
+        vector<string> numbers;
+        numbers.reserve(count);
+        char buffer[64];
+        while (numbers.size() < count) {
+            uint64_t bits = random();
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            switch (numbers.size() % 4) {
+                case 0:
+                    if (!isfinite(value)) {
+                        continue;
+                    }
+                    snprintf(buffer, sizeof(buffer), "%.17g", value);
+                    numbers.push_back(buffer);
+                    break;
+                case 1:
+                    if (!isfinite(value)) {
+                        continue;
+                    }
+                    snprintf(buffer, sizeof(buffer), "%.6e", value);
+                    numbers.push_back(buffer);
+                    break;
+                case 2: {
+                    // coefficient like: short mantissa, small exponent
+                    snprintf(buffer, sizeof(buffer), "%.*f", static_cast<int>(bits % 9),
+                             static_cast<double>(bits >> 40) / 1000.0 * ((bits & 1) ? -1 : 1));
+                    numbers.push_back(buffer);
+                    break;
+                }
+                default: {
+                    // up to 25 significant digits, exponents beyond the range of double
+                    string number = (bits & 1) ? "-" : "";
+                    number += static_cast<char>('1' + random() % 9);
+                    for (size_t i = random() % 12; i > 0; --i) {
+                        number += static_cast<char>('0' + random() % 10);
+                    }
+                    if (random() % 2) {
+                        number += '.';
+                        for (size_t i = 1 + random() % 13; i > 0; --i) {
+                            number += static_cast<char>('0' + random() % 10);
+                        }
+                    }
+                    if (random() % 2) {
+                        number += (random() % 2) ? "e-" : "e";
+                        number += to_string(random() % 340);
+                    }
+                    numbers.push_back(number);
+                    break;
+                }
+            }
+        }
+        return numbers;
+    }
+
+    // A table of coefficients, almost all tokens are numbers
+    static string GenerateNumberSource(size_t bytes)
+    {
+        string src;
+        src.reserve(bytes + 256);
+        auto numbers = GenerateNumbers(4096);
+        size_t idx = 0;
+        while (src.size() < bytes) {
+            src += "def coeff" + to_string(idx) + "(x)\n   ";
+            for (size_t i = 0; i < 8; ++i) {
+                src += " " + numbers[(idx * 8 + i) % numbers.size()] + " * x +";
+            }
+            src += " 0\n";
+            idx++;
+        }
+        return src;
+    }
+
+    // Definitions whose bodies are binary expressions nested 'depth' deep,
+    // alternately through parentheses and through rising precedence.
+    static string GenerateNestedSource(size_t depth, size_t count)
+    {
+        static const char ops[] = {'+', '*', '-', '<'};
+        string src;
+        for (size_t idx = 0; idx < count; ++idx) {
+            src += "def nested" + to_string(idx) + "(x y)\n    ";
+            src += string(depth / 2, '(') + "x";
+            for (size_t level = 0; level < depth / 2; ++level) {
+                src += string(" ") + ops[level % 4] + " " + to_string(level) + ")";
+            }
+            for (size_t level = 0; level < depth - depth / 2; ++level) {
+                src += level % 2 ? " + y" : " * y";
+            }
+            src += "\n";
+        }
+        return src;
+    }
+
+    // 'count' definitions, each one calling two of the previous ones, and
+    // every 1000 definitions a toplevel expression calling the last. The
+    // chains of calls stay logarithmic, the JIT resolves them recursively.
+    static string GenerateCallSource(size_t count)
+    {
+        string src = "def f0(x y) x * 0.5 + y\n";
+        for (size_t idx = 1; idx < count; ++idx) {
+            src += "def f" + to_string(idx) + "(x y) f" + to_string(idx / 2) + "(y, x) * 0.5 + f"
+                + to_string(idx / 3) + "(x, 1) - y\n";
+            if (idx % 1000 == 0 || idx + 1 == count) {
+                src += "f" + to_string(idx) + "(1, 2)\n";
+            }
+        }
+        return src;
+    }
+
+    // Runs the function 'repeat' times, returns the durations in seconds.
+    static vector<double> Measure(const function<void()> &func, size_t repeat)
+    {
+        vector<double> durations;
+        for (size_t i = 0; i < repeat; ++i) {
+            auto start = chrono::steady_clock::now();
+            func();
+            durations.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        }
+        std::sort(durations.begin(), durations.end());
+        return durations;
+    }
+
+    // Runs 'setup' and then times 'func', 'repeat' times.
+    static Result Measure(const function<void()> &setup, const function<void()> &func, size_t repeat)
+    {
+        vector<double> durations;
+        vector<size_t> allocations;
+        for (size_t i = 0; i < repeat; ++i) {
+            setup();
+            size_t allocated = allocationCount;
+            auto start = chrono::steady_clock::now();
+            func();
+            durations.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+            allocations.push_back(allocationCount - allocated);
+        }
+        std::sort(durations.begin(), durations.end());
+        std::sort(allocations.begin(), allocations.end());
+        return Result{Median(durations), Percentile(durations, 99), allocations[allocations.size() / 2]};
+    }
+
+    static double Median(const vector<double> &sorted)
+    {
+        return sorted.empty() ? 0 : sorted[sorted.size() / 2];
+    }
+
+    // nearest rank
+    static double Percentile(const vector<double> &sorted, size_t percent)
+    {
+        if (sorted.empty()) {
+            return 0;
+        }
+        size_t rank = (sorted.size() * percent + 99) / 100;
+        return sorted[max<size_t>(rank, 1) - 1];
+    }
+
+    // Times StringLexer::NextToken, ASTGenerator::Run and ASTGenerator::CodeGen
+    // separately on every generated program. 'scale' multiplies the sizes.
+    static void RunSuite(double scale = 1, size_t repeat = 11)
+    {
+        cout << "scanner: " << Scanner::GetImplementation() << ", " << repeat << " runs" << endl;
+        auto size = [scale](size_t count) {
+            return max<size_t>(1, static_cast<size_t>(count * scale));
+        };
+
+        struct Workload
+        {
+            string name;
+            string src;
+            bool codegen;
+        };
+        vector<Workload> workloads = {
+            {"nested", GenerateNestedSource(size(256), size(2000)), true},
+            {"calls", GenerateCallSource(size(100000)), true},
+            {"numbers", GenerateNumberSource(size(4 << 20)), true},
+            {"comments", GenerateCommentSource(size(16 << 20)), false},
+        };
+
+        for (auto &workload: workloads) {
+            const string &src = workload.src;
+            
+            shared_ptr<Lexer> lexer;
+            size_t tokens = 0;
+            Report(workload.name, "lex", src.size(), Measure([&]() {
+                lexer = make_shared<StringLexer>(src);
+            }, [&]() {
+                tokens = 0;
+                while (lexer->NextToken() != Token::EofToken) {
+                    tokens++;
+                }
+            }, repeat));
+            
+            unique_ptr<ASTGenerator> generator;
+            Report(workload.name, "parse", src.size(), Measure([&]() {
+                generator.reset();
+                generator = make_unique<ASTGenerator>(make_shared<StringLexer>(src));
+            }, [&]() {
+                generator->Run();
+            }, repeat));
+            
+            Report(workload.name, "pipeline", src.size(), Measure([&]() {
+                generator.reset();
+                generator = make_unique<ASTGenerator>(make_shared<StringLexer>(src));
+                generator->UsePipeline(true);
+            }, [&]() {
+                generator->Run();
+            }, repeat));
+            
+            unsigned threads = max(std::thread::hardware_concurrency(), 2u);
+            Report(workload.name, "parse-" + to_string(threads), src.size(), Measure([&]() {
+                generator.reset();
+                generator = make_unique<ASTGenerator>(make_shared<StringLexer>(src));
+                generator->UseParallelParse(threads);
+            }, [&]() {
+                generator->Run();
+            }, repeat));
+            
+            if (workload.codegen) {
+                // the JIT is much slower than the front end, fewer runs
+                Report(workload.name, "codegen", src.size(), Measure([&]() {
+                    generator.reset();
+                    generator = make_unique<ASTGenerator>(make_shared<StringLexer>(src));
+                    generator->SetPrintIR(false);
+                    generator->Run();
+                }, [&]() {
+                    generator->CodeGen();
+                }, max<size_t>(1, repeat / 4)));
+                
+                Report(workload.name, "codegen-" + to_string(threads), src.size(), Measure([&]() {
+                    generator.reset();
+                    generator = make_unique<ASTGenerator>(make_shared<StringLexer>(src));
+                    generator->SetPrintIR(false);
+                    generator->UseParallelCodeGen(threads);
+                    generator->Run();
+                }, [&]() {
+                    generator->CodeGen();
+                }, max<size_t>(1, repeat / 4)));
+            }
+            generator.reset();
+            cout << "  " << src.size() << " bytes, " << tokens << " tokens" << endl;
+        }
+    }
+
+    static void Report(const string &workload, const string &phase, size_t bytes, const Result &result)
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "%-10s %-10s median %10.3f ms  p99 %10.3f ms  %9.2f MB/s  %10zu allocations",
+                 workload.c_str(), phase.c_str(), result.median * 1e3, result.p99 * 1e3,
+                 bytes / result.median / (1 << 20), result.allocations);
+        cout << line << endl;
+    }
+
+    // Lexing throughput of StringLexer in bytes/sec against the baseline
+    static void RunLexer(size_t bytes = 64 << 20, size_t repeat = 5)
+    {
+        cout << "scanner: " << Scanner::GetImplementation() << endl;
+        RunLexer("lexer (code)", GenerateSource(bytes), repeat);
+        RunLexer("lexer (comments)", GenerateCommentSource(bytes), repeat);
+    }
+
+    // Checks that numbers are lexed to the same bits as stod, then compares
+    // the conversion speed unless 'repeat' is 0. Returns the number of
+    // mismatches.
+    static size_t RunNumbers(size_t count = 1 << 20, size_t repeat = 5)
+    {
+        auto numbers = GenerateNumbers(count);
+        size_t mismatches = 0;
+        for (auto &number: numbers) {
+            // the lexer must take the whole literal as one number
+            StringLexer lexer(number);
+            Token token = lexer.NextToken();
+            if (!token.IsNumber() || token.GetContent() != number || lexer.NextToken() != Token::EofToken) {
+                cout << "not lexed as a single number: " << number << endl;
+                mismatches++;
+                continue;
+            }
+            
+            // stod is strtod plus range checks, strtod also gives the
+            // reference for the values stod would reject
+            double expected = strtod(number.c_str(), nullptr);
+            double actual = token.GetNumeric();
+            if (memcmp(&expected, &actual, sizeof(double)) != 0) {
+                cout << "mismatch: " << number << " " << expected << " " << actual << endl;
+                mismatches++;
+            }
+        }
+        cout << "numbers: " << numbers.size() << " literals checked, " << mismatches << " mismatches" << endl;
+        if (repeat == 0) {
+            return mismatches;
+        }
+
+        double sum = 0;
+        auto fast = Measure([&]() {
+            for (auto &number: numbers) {
+                sum += Lexer::ToDouble(number);
+            }
+        }, repeat);
+        auto slow = Measure([&]() {
+            for (auto &number: numbers) {
+                sum += strtod(number.c_str(), nullptr);
+            }
+        }, repeat);
+        cout << "numbers: ToDouble " << Median(fast) / numbers.size() * 1e9 << " ns/literal, strtod "
+            << Median(slow) / numbers.size() * 1e9 << " ns/literal (" << (sum != 0) << ")" << endl;
+
+        RunLexer("lexer (numbers)", GenerateNumberSource(64 << 20), repeat);
+        return mismatches;
+    }
+
+    // Checks the expression parser: random expressions must evaluate like a
+    // separate recursive descent evaluator of the text, and very wide and
+    // very deep expressions must parse into the expected number of nodes
+    // without growing the stack. Returns the number of failures.
+    static size_t RunParser(size_t count = 20000, size_t size = 100000)
+    {
+        size_t failures = 0;
+        mt19937 random(42);
+        for (size_t i = 0; i < count; ++i) {
+            string text = GenerateExpression(random, 5);
+            const char *cursor = text.c_str();
+            double expected = EvaluateText(cursor);
+            ASTGenerator generator(make_shared<StringLexer>(text));
+            generator.Run();
+            auto &nodes = generator.GetASTNodes();
+            double actual = nodes.size() == 1 ? Evaluate(static_cast<FunctionAST *>(nodes[0])->body) : NAN;
+            if (memcmp(&expected, &actual, sizeof(double)) != 0) {
+                cout << "parser mismatch: " << text << " " << expected << " " << actual << endl;
+                failures++;
+            }
+        }
+        cout << "parser: " << count << " random expressions checked, " << failures << " failures" << endl;
+
+        // a chain of binary operators, right-nested parentheses and nested calls
+        string sum = "x";
+        string parens;
+        string calls;
+        for (size_t i = 0; i < size; ++i) {
+            sum += " + x * 2";
+            parens += "(1 - ";
+            calls += "f(";
+        }
+        parens += "x" + string(size, ')');
+        calls += "x" + string(size, ')');
+        failures += CheckPathological("width", "def w(x) " + sum, size * 4 + 1);
+        failures += CheckPathological("parens", "def p(x) " + parens, size * 2 + 1);
+        failures += CheckPathological("calls", "def c(x) " + calls, size + 1);
+        return failures;
+    }
+
+    // Compares calling a definition once per row with its batch kernel, and
+    // times both unless 'repeat' is 0. Returns the number of rows where they
+    // differ.
+    static size_t RunBatch(size_t rows = 1 << 20, size_t repeat = 5)
+    {
+        string src = "extern sqrt(x)\n"
+                     "def foo(x y) sqrt(x * x + y * y) * 0.5 + x * y - 3 * (y < x)\n";
+        ASTGenerator generator(make_shared<StringLexer>(src), OptLevel::O2);
+        generator.SetPrintIR(false);
+        generator.Run();
+        generator.CodeGen();
+        auto scalar = reinterpret_cast<double (*)(double, double)>(generator.LookupFunction("foo"));
+        auto batch = reinterpret_cast<void (*)(const double *, const double *, double *, size_t)>(
+            generator.CompileBatch("foo"));
+        if (!scalar || !batch) {
+            cout << "batch: compilation failed" << endl;
+            return rows;
+        }
+
+        vector<double> x(rows), y(rows), rowOut(rows), batchOut(rows);
+        mt19937_64 random(42);
+        uniform_real_distribution<double> values(-100, 100);
+        for (size_t i = 0; i < rows; ++i) {
+            x[i] = values(random);
+            y[i] = values(random);
+        }
+        auto perRow = [&]() {
+            for (size_t i = 0; i < rows; ++i) {
+                rowOut[i] = scalar(x[i], y[i]);
+            }
+        };
+        auto perBatch = [&]() {
+            batch(x.data(), y.data(), batchOut.data(), rows);
+        };
+        perRow();
+        perBatch();
+        size_t mismatches = 0;
+        for (size_t i = 0; i < rows; ++i) {
+            if (memcmp(&rowOut[i], &batchOut[i], sizeof(double)) != 0) {
+                mismatches++;
+            }
+        }
+        if (repeat == 0) {
+            cout << "batch: " << rows << " rows checked, " << mismatches << " mismatches" << endl;
+            return mismatches;
+        }
+
+        auto rowTimes = Measure(perRow, repeat);
+        auto batchTimes = Measure(perBatch, repeat);
+        cout << "batch: " << rows << " rows, per row " << Median(rowTimes) / rows * 1e9 << " ns/row, batch "
+            << Median(batchTimes) / rows * 1e9 << " ns/row, " << mismatches << " mismatches" << endl;
+        return mismatches;
+    }
+
+    // What the type inference costs and gains. Compiles the calls workload,
+    // where the integer arguments do no integer work and nothing is cloned,
+    // with and without it, then runs a program counting down an integer
+    // that calls a long sum of integers, which the clones fold. Returns the
+    // number of runs where the results differ, only checks them when
+    // 'repeat' is 0.
+    static size_t RunTypes(size_t count = 10000, size_t repeat = 5)
+    {
+        string src = "def chain(n) n";
+        for (size_t idx = 1; idx <= 32; ++idx) {
+            src += " + " + to_string(idx % 7) + " + n";
+        }
+        src += "\ndef sumto(n) if n < 1 then 0 else chain(n) + sumto(n - 1)\n"
+               "def run() sumto(" + to_string(count) + ")\n";
+        unique_ptr<ASTGenerator> generators[2];
+        double (*run[2])() = {nullptr, nullptr};
+        for (int types = 0; types < 2; ++types) {
+            generators[types] = make_unique<ASTGenerator>(make_shared<StringLexer>(src), OptLevel::O2);
+            generators[types]->SetPrintIR(false);
+            generators[types]->UseTypeInference(types);
+            generators[types]->Run();
+            generators[types]->CodeGen();
+            run[types] = reinterpret_cast<double (*)()>(generators[types]->LookupFunction("run"));
+            if (!run[types]) {
+                cout << "types: compilation failed" << endl;
+                return 1;
+            }
+        }
+        double results[2] = {run[0](), run[1]()};
+        size_t mismatches = memcmp(&results[0], &results[1], sizeof(double)) != 0;
+        if (repeat == 0) {
+            cout << "types: " << count << " integers summed, " << mismatches << " mismatches" << endl;
+            return mismatches;
+        }
+
+        string calls = GenerateCallSource(count);
+        double compile[2];
+        double runTime[2];
+        for (int types = 0; types < 2; ++types) {
+            unique_ptr<ASTGenerator> generator;
+            compile[types] = Measure([&]() {
+                generator.reset();
+                generator = make_unique<ASTGenerator>(make_shared<StringLexer>(calls));
+                generator->SetPrintIR(false);
+                generator->UseTypeInference(types);
+                generator->Run();
+            }, [&]() {
+                generator->CodeGen();
+            }, repeat).median;
+            // a run is short, time a hundred
+            runTime[types] = Median(Measure([&]() {
+                for (int idx = 0; idx < 100; ++idx) {
+                    results[types] = run[types]();
+                }
+            }, repeat)) / 100;
+            if (memcmp(&results[0], &results[types], sizeof(double)) != 0) {
+                mismatches++;
+            }
+        }
+        cout << "types: compile calls " << compile[0] * 1e3 << " ms, with types " << compile[1] * 1e3
+            << " ms; run " << runTime[0] * 1e6 << " us, with types " << runTime[1] * 1e6 << " us, "
+            << mismatches << " mismatches" << endl;
+        return mismatches;
+    }
+
+    // A random expression of numbers, the binary operators and parentheses.
+    static string GenerateExpression(mt19937 &random, size_t depth)
+    {
+        static const char ops[] = {'+', '-', '*', '<'};
+        if (depth == 0 || random() % 4 == 0) {
+            return to_string(random() % 10);
+        }
+        string text = GenerateExpression(random, depth - 1);
+        for (size_t terms = random() % 4; terms > 0; --terms) {
+            text += string(" ") + ops[random() % 4] + " " + GenerateExpression(random, depth - 1);
+        }
+        return random() % 3 == 0 ? "(" + text + ")" : text;
+    }
+
+    // The reference: recursive descent over the text with one function per
+    // precedence level, all the operators left associative.
+    static double EvaluateText(const char *&cursor, int level = 0)
+    {
+        static const string levels[] = {"<", "+-", "*"};
+        if (level == 3) {
+            while (*cursor == ' ') {
+                cursor++;
+            }
+            if (*cursor == '(') {
+                cursor++;
+                double value = EvaluateText(cursor);
+                cursor++;  // ')'
+                return value;
+            }
+            return static_cast<double>(*cursor++ - '0');
+        }
+        double value = EvaluateText(cursor, level + 1);
+        while (true) {
+            while (*cursor == ' ') {
+                cursor++;
+            }
+            if (!*cursor || levels[level].find(*cursor) == string::npos) {
+                return value;
+            }
+            char op = *cursor++;
+            double rhs = EvaluateText(cursor, level + 1);
+            value = op == '+' ? value + rhs : op == '-' ? value - rhs : op == '*' ? value * rhs : (value < rhs ? 1.0 : 0.0);
+        }
+    }
+
+    // Evaluates numbers and binary operators of a parsed tree, iteratively.
+    static double Evaluate(ExprAST *root)
+    {
+        vector<pair<ExprAST *, bool>> stack{{root, false}};
+        vector<double> values;
+        while (!stack.empty()) {
+            auto [node, expanded] = stack.back();
+            stack.pop_back();
+            if (!node) {
+                values.push_back(NAN);
+            } else if (node->kind == ASTNode::NumberKind) {
+                values.push_back(static_cast<NumberExprAST *>(node)->value);
+            } else if (node->kind != ASTNode::BinaryKind) {
+                values.push_back(NAN);
+            } else if (!expanded) {
+                auto *binary = static_cast<BinaryExprAST *>(node);
+                stack.push_back({node, true});
+                stack.push_back({binary->right, false});
+                stack.push_back({binary->left, false});
+            } else {
+                double rhs = values.back();
+                values.pop_back();
+                double &lhs = values.back();
+                switch (static_cast<BinaryExprAST *>(node)->op) {
+                    case '+': lhs = lhs + rhs; break;
+                    case '-': lhs = lhs - rhs; break;
+                    case '*': lhs = lhs * rhs; break;
+                    default: lhs = lhs < rhs ? 1.0 : 0.0; break;
+                }
+            }
+        }
+        return values.back();
+    }
+
+    // Parses a definition and compares the number of nodes of its body.
+    static size_t CheckPathological(const string &name, const string &src, size_t expectedNodes)
+    {
+        Stats stats;
+        ASTGenerator generator(make_shared<StringLexer>(src));
+        generator.SetStats(&stats);
+        auto start = chrono::steady_clock::now();
+        generator.Run();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        size_t nodes = stats.GetNodes(ASTNode::NumberKind) + stats.GetNodes(ASTNode::VariableKind) +
+            stats.GetNodes(ASTNode::BinaryKind) + stats.GetNodes(ASTNode::CallKind);
+        bool ok = generator.GetASTNodes().size() == 1 && nodes == expectedNodes;
+        cout << "parser (" << name << "): " << src.size() << " bytes, " << nodes << " nodes, "
+            << seconds * 1000 << " ms" << (ok ? "" : ", FAILED") << endl;
+        return ok ? 0 : 1;
+    }
+
+    // Lexes the source with the baseline and with StringLexer, reports the
+    // throughput of both and the ratio.
+    static void RunLexer(const string &name, const string &src, size_t repeat)
+    {
+        size_t count = 0;
+        auto durations = Measure([&]() {
+            shared_ptr<Lexer> lexer = make_shared<StringLexer>(src);
+            count = 0;
+            while (lexer->NextToken() != Token::EofToken) {
+                count++;
+            }
+        }, repeat);
+        size_t baselineCount = 0;
+        auto baselineDurations = Measure([&]() {
+            BaselineLexer lexer(src);
+            baselineCount = 0;
+            while (lexer.NextToken().type != Token::Eof) {
+                baselineCount++;
+            }
+        }, repeat);
+
+        double median = Median(durations);
+        double baseline = Median(baselineDurations);
+        cout << name << ": " << src.size() << " bytes, " << count << " tokens, median "
+            << median * 1000 << " ms, " << src.size() / median / (1 << 20) << " MB/s, baseline "
+            << baseline * 1000 << " ms, " << src.size() / baseline / (1 << 20) << " MB/s, "
+            << baseline / median << "x";
+        if (baselineCount != count) {
+            cout << " (baseline lexed " << baselineCount << " tokens)";
+        }
+        cout << endl;
+    }
+};
+
+};
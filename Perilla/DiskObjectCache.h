@@ -0,0 +1,339 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include "AST.h"
+#include "Optimizer.h"
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA1.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+// Keeps the machine code compiled by the JIT in a directory, one object
+// file per definition, named after a hash of everything the code depends
+// on. A module is only cached when its identifier is a key made by Key().
+// Files are written to a temporary name and renamed, so readers never see
+// partial objects. Once the directory grows over the size limit the least
+// recently used objects are removed. It's called from the compile threads
+// of the JIT, so the bookkeeping is locked. Code generation asks for an
+// object with Hold() before the JIT does, and skips the optimization when
+// it's there; the object is read then and kept for getObject(), as it may
+// be evicted in between and the unoptimized module must not be compiled
+// and cached under its key.
+class DiskObjectCache: public ObjectCache
+{
+public:
+    static constexpr size_t DefaultMaxBytes = 256 << 20;
+
+    DiskObjectCache(const string &dir, size_t maxBytes = DefaultMaxBytes)
+    : directory(dir), maxBytes(maxBytes), diskBytes(0), hits(0), misses(0), bytesRead(0), bytesWritten(0),
+      evictions(0), tempCounter(0)
+    {
+        error_code ec;
+        std::filesystem::create_directories(directory, ec);
+        for (auto &entry: std::filesystem::directory_iterator(directory, ec)) {
+            if (entry.is_regular_file(ec) && entry.path().extension() == ".o") {
+                diskBytes += entry.file_size(ec);
+            }
+        }
+        if (diskBytes > maxBytes) {
+            Evict();
+        }
+    }
+
+    // The key of a definition: a SHA1 of its prototype and body, the
+    // optimization level, the target, the LLVM version, the externs that
+    // are intrinsics and the integer clones the module defines or calls.
+    static string Key(const FunctionAST &func, OptLevel level, const Triple &triple, string_view intrinsics,
+                      string_view clones)
+    {
+        string text;
+        text += LLVM_VERSION_STRING;
+        text += '\0';
+        text += triple.str();
+        text += '\0';
+        text += sys::getHostCPUName().str();
+        text += '\0';
+        text += static_cast<char>(level);
+        text += intrinsics;
+        text += '\0';
+        text += clones;
+        text += '\0';
+        Serialize(&func, text);
+
+        SHA1 hash;
+        hash.update(text);
+        return KeyPrefix + toHex(hash.final(), true);
+    }
+
+    static bool IsKey(StringRef identifier)
+    {
+        return identifier.startswith(KeyPrefix);
+    }
+
+    // Reads the object of 'key' and keeps it until the JIT asks for it.
+    // Returns false if there is none.
+    bool Hold(const string &key)
+    {
+        string path = PathOf(key);
+        auto buffer = MemoryBuffer::getFile(path, false, false);
+        if (!buffer) {
+            return false;
+        }
+        lock_guard<mutex> lock(bookkeeping);
+        held[key] = move(*buffer);
+        // recently used, see Evict
+        error_code ec;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+        return true;
+    }
+
+    void notifyObjectCompiled(const Module *module, MemoryBufferRef object) override
+    {
+        StringRef key = module->getModuleIdentifier();
+        if (!IsKey(key)) {
+            return;
+        }
+
+        // write a temporary file next to the final one, then move it in place
+        string path = PathOf(key.str());
+        string temp = path + ".tmp." + to_string(getpid()) + "." + to_string(tempCounter++);
+        {
+            ofstream out(temp, ios::binary | ios::trunc);
+            out.write(object.getBufferStart(), object.getBufferSize());
+            if (!out) {
+                cout << "Cannot write " << temp << endl;
+                out.close();
+                remove(temp.c_str());
+                return;
+            }
+        }
+        if (rename(temp.c_str(), path.c_str()) != 0) {
+            remove(temp.c_str());
+            return;
+        }
+
+        lock_guard<mutex> lock(bookkeeping);
+        bytesWritten += object.getBufferSize();
+        diskBytes += object.getBufferSize();
+        if (diskBytes > maxBytes) {
+            Evict();
+        }
+    }
+
+    unique_ptr<MemoryBuffer> getObject(const Module *module) override
+    {
+        StringRef key = module->getModuleIdentifier();
+        if (!IsKey(key)) {
+            return nullptr;
+        }
+
+        {
+            lock_guard<mutex> lock(bookkeeping);
+            auto found = held.find(key.str());
+            if (found != held.end()) {
+                unique_ptr<MemoryBuffer> object = move(found->second);
+                held.erase(found);
+                hits++;
+                bytesRead += object->getBufferSize();
+                return object;
+            }
+        }
+
+        string path = PathOf(key.str());
+        auto buffer = MemoryBuffer::getFile(path, false, false);
+        lock_guard<mutex> lock(bookkeeping);
+        if (!buffer) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        bytesRead += (*buffer)->getBufferSize();
+        // recently used, see Evict
+        error_code ec;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+        return move(*buffer);
+    }
+
+    string GetString() const
+    {
+        lock_guard<mutex> lock(bookkeeping);
+        return "Object cache: " + to_string(hits) + " hits, " + to_string(misses) + " misses, " +
+            to_string(bytesRead) + " bytes read, " + to_string(bytesWritten) + " bytes written, " +
+            to_string(evictions) + " evicted, " + to_string(diskBytes) + " bytes on disk";
+    }
+
+    string GetJSON() const
+    {
+        lock_guard<mutex> lock(bookkeeping);
+        return "{\"hits\": " + to_string(hits) + ", \"misses\": " + to_string(misses) + ", \"bytes_read\": " +
+            to_string(bytesRead) + ", \"bytes_written\": " + to_string(bytesWritten) + ", \"evicted\": " +
+            to_string(evictions) + ", \"bytes_on_disk\": " + to_string(diskBytes) + "}";
+    }
+
+private:
+    string PathOf(const string &key) const
+    {
+        return directory + "/" + key.substr(KeyPrefix.size()) + ".o";
+    }
+
+    // Removes the least recently used objects until the directory is below
+    // 3/4 of the limit, so that it doesn't happen on every write.
+    void Evict()
+    {
+        struct Entry
+        {
+            std::filesystem::path path;
+            std::filesystem::file_time_type time;
+            size_t size;
+        };
+        vector<Entry> entries;
+        error_code ec;
+        size_t total = 0;
+        for (auto &entry: std::filesystem::directory_iterator(directory, ec)) {
+            if (entry.is_regular_file(ec) && entry.path().extension() == ".o") {
+                entries.push_back({entry.path(), entry.last_write_time(ec), entry.file_size(ec)});
+                total += entries.back().size;
+            }
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            return a.time < b.time;
+        });
+        for (auto &entry: entries) {
+            if (total <= maxBytes / 4 * 3) {
+                break;
+            }
+            if (std::filesystem::remove(entry.path, ec)) {
+                total -= entry.size;
+                evictions++;
+            }
+        }
+        diskBytes = total;
+    }
+
+    // Appends the nodes in preorder, every kind has a fixed shape so the
+    // text is unambiguous. A shared node seen before is written as its
+    // number in the order of the shared nodes.
+    static void Serialize(const ASTNode *root, string &text)
+    {
+        vector<const ASTNode *> stack{root};
+        unordered_map<const ASTNode *, size_t> sharedNodes;
+        while (!stack.empty()) {
+            const ASTNode *node = stack.back();
+            stack.pop_back();
+            if (!node) {
+                text += '\xff';
+                continue;
+            }
+            if (node->kind == ASTNode::BinaryKind && static_cast<const ExprAST *>(node)->shared) {
+                auto inserted = sharedNodes.emplace(node, sharedNodes.size());
+                if (!inserted.second) {
+                    text += '\xfe' + to_string(inserted.first->second) + ':';
+                    continue;
+                }
+            }
+            text += static_cast<char>(node->kind);
+            switch (node->kind) {
+                case ASTNode::NumberKind: {
+                    double value = static_cast<const NumberExprAST *>(node)->value;
+                    text.append(reinterpret_cast<const char *>(&value), sizeof(value));
+                    break;
+                }
+                case ASTNode::VariableKind:
+                    AppendName(static_cast<const VariableExprAST *>(node)->variable, text);
+                    break;
+                case ASTNode::BinaryKind: {
+                    auto *binary = static_cast<const BinaryExprAST *>(node);
+                    text += binary->op;
+                    stack.push_back(binary->right);
+                    stack.push_back(binary->left);
+                    break;
+                }
+                case ASTNode::CallKind: {
+                    auto *call = static_cast<const CallExprAST *>(node);
+                    AppendName(call->callee, text);
+                    text += to_string(call->args.size()) + ':';
+                    for (size_t idx = call->args.size(); idx > 0; --idx) {
+                        stack.push_back(call->args[idx - 1]);
+                    }
+                    break;
+                }
+                case ASTNode::IfKind: {
+                    auto *ifExpr = static_cast<const IfExprAST *>(node);
+                    stack.push_back(ifExpr->elseExpr);
+                    stack.push_back(ifExpr->thenExpr);
+                    stack.push_back(ifExpr->cond);
+                    break;
+                }
+                case ASTNode::ForKind: {
+                    // a missing step is the null marker
+                    auto *forExpr = static_cast<const ForExprAST *>(node);
+                    AppendName(forExpr->variable, text);
+                    stack.push_back(forExpr->body);
+                    stack.push_back(forExpr->step);
+                    stack.push_back(forExpr->end);
+                    stack.push_back(forExpr->start);
+                    break;
+                }
+                case ASTNode::PrototypeKind: {
+                    auto *proto = static_cast<const PrototypeAST *>(node);
+                    AppendName(proto->name, text);
+                    text += to_string(proto->args.size()) + ':';
+                    for (auto arg: proto->args) {
+                        AppendName(arg, text);
+                    }
+                    break;
+                }
+                case ASTNode::FunctionKind: {
+                    auto *func = static_cast<const FunctionAST *>(node);
+                    stack.push_back(func->body);
+                    stack.push_back(func->prototype);
+                    break;
+                }
+            }
+        }
+    }
+
+    static void AppendName(string_view name, string &text)
+    {
+        text += name;
+        text += '\0';
+    }
+
+    static const string KeyPrefix;
+
+    string directory;
+    size_t maxBytes;
+    mutable mutex bookkeeping;
+    unordered_map<string, unique_ptr<MemoryBuffer>> held;  // by Hold, for getObject
+    size_t diskBytes;
+    size_t hits;
+    size_t misses;
+    size_t bytesRead;
+    size_t bytesWritten;
+    size_t evictions;
+    atomic<size_t> tempCounter;
+};
+
+const string DiskObjectCache::KeyPrefix = "perilla-cache-";
+
+};
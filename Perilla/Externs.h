@@ -0,0 +1,158 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <map>
+#include <utility>
+#include <type_traits>
+#include <cstdio>
+#include <cstdint>
+
+#include "llvm/IR/Intrinsics.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+// The externs of libm that have an LLVM intrinsic of the same meaning. The
+// intrinsics are readnone and nounwind, so the optimizer folds them on
+// constants, hoists them out of loops and the vectorizer can widen them.
+struct IntrinsicExtern
+{
+    const char *name;
+    Intrinsic::ID id;
+    size_t argCount;
+};
+
+static const IntrinsicExtern intrinsicExterns[] = {
+    {"sin", Intrinsic::sin, 1},
+    {"cos", Intrinsic::cos, 1},
+    {"exp", Intrinsic::exp, 1},
+    {"exp2", Intrinsic::exp2, 1},
+    {"log", Intrinsic::log, 1},
+    {"log2", Intrinsic::log2, 1},
+    {"log10", Intrinsic::log10, 1},
+    {"sqrt", Intrinsic::sqrt, 1},
+    {"fabs", Intrinsic::fabs, 1},
+    {"floor", Intrinsic::floor, 1},
+    {"ceil", Intrinsic::ceil, 1},
+    {"trunc", Intrinsic::trunc, 1},
+    {"round", Intrinsic::round, 1},
+    {"pow", Intrinsic::pow, 2},
+    {"fmin", Intrinsic::minnum, 2},
+    {"fmax", Intrinsic::maxnum, 2},
+    {"copysign", Intrinsic::copysign, 2},
+    {"fma", Intrinsic::fma, 3},
+};
+
+// What the 'extern' prototypes of a program bind to. An extern of the table
+// above becomes its intrinsic, an extern registered here becomes the address
+// of the host function, known to the JIT up front instead of being looked
+// up in the symbols of the process. Any other extern is still looked up.
+// An extern the program also defines is left to the definition.
+class ExternRegistry
+{
+public:
+    struct HostFunction
+    {
+        uint64_t address;
+        size_t argCount;
+    };
+
+    ExternRegistry()
+    {
+        Register("putchard", &PutCharD);
+        Register("printd", &PrintD);
+    }
+
+    // Makes 'func' the target of 'extern name(...)' for the programs bound
+    // afterwards. The host function takes and returns doubles only.
+    template<typename... Args>
+    void Register(string name, double (*func)(Args...))
+    {
+        static_assert((is_same_v<Args, double> && ...), "host functions take doubles only");
+        hosts[move(name)] = HostFunction{reinterpret_cast<uint64_t>(func), sizeof...(Args)};
+    }
+
+    // Binds the externs of a program, given by name and argument count,
+    // 'defined' are the names of its definitions. Forgets the bindings of
+    // the previous program. An extern with an argument count different from
+    // its intrinsic or host function is not bound.
+    void Bind(const vector<pair<string_view, size_t>> &externs, const set<string_view> &defined)
+    {
+        boundIntrinsics.clear();
+        boundHosts.clear();
+        for (auto &[name, argCount]: externs) {
+            if (defined.count(name)) {
+                continue;
+            }
+            if (const IntrinsicExtern *intrinsic = LookupIntrinsic(name)) {
+                if (intrinsic->argCount == argCount) {
+                    boundIntrinsics[string(name)] = intrinsic;
+                }
+                continue;
+            }
+            auto iter = hosts.find(name);
+            if (iter != hosts.end() && iter->second.argCount == argCount) {
+                boundHosts[string(name)] = iter->second;
+            }
+        }
+    }
+
+    // The intrinsic an extern of the bound program is, nullptr if none.
+    const IntrinsicExtern *FindIntrinsic(string_view name) const
+    {
+        auto iter = boundIntrinsics.find(name);
+        return iter != boundIntrinsics.end() ? iter->second : nullptr;
+    }
+
+    const map<string, HostFunction, less<>> &GetHostBindings() const
+    {
+        return boundHosts;
+    }
+
+    // The externs bound to intrinsics, a definition calling one of them
+    // compiles differently than when it's a plain call.
+    string GetIntrinsicNames() const
+    {
+        string names;
+        for (auto &entry: boundIntrinsics) {
+            names += entry.first;
+            names += ' ';
+        }
+        return names;
+    }
+
+    static const IntrinsicExtern *LookupIntrinsic(string_view name)
+    {
+        for (auto &entry: intrinsicExterns) {
+            if (name == entry.name) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    // the host functions of the Kaleidoscope tutorial
+    static double PutCharD(double x)
+    {
+        fputc(static_cast<char>(x), stderr);
+        return 0;
+    }
+
+    static double PrintD(double x)
+    {
+        fprintf(stderr, "%f\n", x);
+        return 0;
+    }
+
+    map<string, HostFunction, less<>> hosts;
+    map<string, const IntrinsicExtern *, less<>> boundIntrinsics;
+    map<string, HostFunction, less<>> boundHosts;
+};
+
+};
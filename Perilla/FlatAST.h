@@ -0,0 +1,516 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <cstdint>
+#include "AST.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+// A compact struct-of-arrays form of the AST. Every node is an index into
+// parallel arrays, children are linked by 32-bit indices, the values of the
+// numbers live in a constant pool and the names in a symbol array. All the
+// traversals switch on the kind of the node instead of virtual calls.
+class FlatAST
+{
+public:
+    using Index = uint32_t;
+    using Kind = ASTNode::Kind;
+
+    // the missing step of a loop
+    static constexpr Index NoNode = UINT32_MAX;
+
+    FlatAST() = default;
+
+    explicit FlatAST(const vector<ASTNode *> &nodes)
+    {
+        roots.reserve(nodes.size());
+        for (auto *node: nodes) {
+            roots.push_back(Add(node));
+        }
+        sharedIndices.clear();
+    }
+
+    size_t Size() const
+    {
+        return kinds.size();
+    }
+
+    const vector<Index> &GetRoots() const
+    {
+        return roots;
+    }
+
+    Kind GetKind(Index node) const
+    {
+        return static_cast<Kind>(kinds[node]);
+    }
+
+    // same output as ASTNode::GetString
+    string GetString(Index node) const
+    {
+        switch (GetKind(node)) {
+            case Kind::NumberKind:
+                return "Number Expr: " + to_string(constants[payload[node]]);
+            case Kind::VariableKind:
+                return "Variable Expr: " + string(symbols[payload[node]]);
+            case Kind::BinaryKind:
+                return "Binary Expr: " + string(1, static_cast<char>(payload[node]));
+            case Kind::CallKind:
+                return "Call Function: " + string(symbols[payload[node]]);
+            case Kind::IfKind:
+                return "If Expr";
+            case Kind::ForKind:
+                return "For Expr: " + string(symbols[payload[node]]);
+            case Kind::PrototypeKind: {
+                string buffer = "Prototype: ";
+                buffer += symbols[payload[node]];
+                buffer += "(";
+                for (Index i = 0; i < second[node]; ++i) {
+                    if (i != 0) buffer += " ";
+                    buffer += symbols[lists[first[node] + i]];
+                }
+                buffer += ")";
+                return buffer;
+            }
+            case Kind::FunctionKind:
+                return "Function Definition: " + GetString(payload[node]);
+        }
+        return "Expr";
+    }
+
+    void Print() const
+    {
+        for (Index root: roots) {
+            cout << GetString(root) << endl;
+        }
+    }
+
+    Value *CodeGen(Index node) const
+    {
+        switch (GetKind(node)) {
+            case Kind::PrototypeKind: {
+                vector<string> args;
+                for (Index i = 0; i < second[node]; ++i) {
+                    args.emplace_back(symbols[lists[first[node] + i]]);
+                }
+                return DeclareFunction(symbols[payload[node]], move(args));
+            }
+            case Kind::FunctionKind: {
+                Index proto = payload[node];
+                Function *func = module->getFunction(symbols[payload[proto]]);
+                if (!func) {
+                    func = static_cast<Function *>(CodeGen(proto));
+                }
+                Index body = first[node];
+                return EmitFunction(func, [this, body]() {
+                    return EmitExpr(body);
+                });
+            }
+            default:
+                return EmitExpr(node);
+        }
+    }
+
+private:
+    // Like EmitExpr of AST.h: an explicit stack of the nodes and the stages
+    // they are in, children from left to right, so that deep trees don't
+    // grow the native stack.
+    Value *EmitExpr(Index root) const
+    {
+        struct Frame
+        {
+            Index node;
+            int stage;  // how many children are emitted
+        };
+        struct Branch
+        {
+            BasicBlock *elseBlock, *mergeBlock, *thenEnd;
+            Value *thenValue;
+            size_t scope;
+        };
+        struct Loop
+        {
+            BasicBlock *loopBlock;
+            PHINode *variable;
+            Value *outer;  // the value the loop variable hides
+            Value *next;
+            size_t scope;
+            bool failed;
+        };
+        vector<Frame> stack{{root, 0}};
+        vector<Value *> values;
+        vector<Branch> branches;
+        vector<Loop> loops;
+        auto pop = [&values]() {
+            Value *value = values.back();
+            values.pop_back();
+            return value;
+        };
+        while (!stack.empty()) {
+            Frame frame = stack.back();
+            stack.pop_back();
+            Index node = frame.node;
+            switch (GetKind(node)) {
+                case Kind::NumberKind:
+                    values.push_back(ConstantFP::get(*context, APFloat(constants[payload[node]])));
+                    break;
+                case Kind::VariableKind: {
+                    auto iter = symbolTable.find(symbols[payload[node]]);
+                    values.push_back(iter != symbolTable.end() ? iter->second : LogErrorV("Unknow variable name"));
+                    break;
+                }
+                case Kind::BinaryKind: {
+                    if (frame.stage == 0) {
+                        auto iter = shared[node] ? sharedValues.find(node) : sharedValues.end();
+                        if (iter != sharedValues.end()) {
+                            values.push_back(iter->second);
+                            break;
+                        }
+                        stack.push_back({node, 1});
+                        stack.push_back({second[node], 0});
+                        stack.push_back({first[node], 0});
+                        break;
+                    }
+                    Value *rhs = pop();
+                    Value *lhs = pop();
+                    Value *value = lhs && rhs ? EmitBinary(static_cast<char>(payload[node]), lhs, rhs) : nullptr;
+                    if (shared[node] && value) {
+                        RememberShared(node, value);
+                    }
+                    values.push_back(value);
+                    break;
+                }
+                case Kind::CallKind: {
+                    string_view callee = symbols[payload[node]];
+                    Index argCount = second[node];
+                    if (frame.stage == 0) {
+                        // the callee is checked before any argument is emitted
+                        Function *func = GetFunction(callee);
+                        if (!func || func->arg_size() != argCount) {
+                            values.push_back(EmitCall(callee, argCount, [](size_t) {
+                                return nullptr;
+                            }));
+                            break;
+                        }
+                        stack.push_back({node, 1});
+                        for (Index idx = argCount; idx > 0; --idx) {
+                            stack.push_back({lists[first[node] + idx - 1], 0});
+                        }
+                        break;
+                    }
+                    size_t args = values.size() - argCount;
+                    Value *value = EmitCall(callee, argCount, [&values, args](size_t idx) {
+                        return values[args + idx];
+                    });
+                    values.resize(args);
+                    values.push_back(value);
+                    break;
+                }
+                case Kind::IfKind: {
+                    // the children cond, then and else
+                    const Index *children = &lists[first[node]];
+                    Function *func = builder->GetInsertBlock()->getParent();
+                    if (frame.stage == 0) {
+                        stack.push_back({node, 1});
+                        stack.push_back({children[0], 0});
+                    } else if (frame.stage == 1) {
+                        Value *cond = pop();
+                        if (!cond) {
+                            values.push_back(nullptr);
+                            break;
+                        }
+                        BasicBlock *thenBlock = BasicBlock::Create(*context, "then", func);
+                        BasicBlock *elseBlock = BasicBlock::Create(*context, "else");
+                        BasicBlock *mergeBlock = BasicBlock::Create(*context, "ifcont");
+                        builder->CreateCondBr(ToCondition(cond), thenBlock, elseBlock);
+                        builder->SetInsertPoint(thenBlock);
+                        branches.push_back({elseBlock, mergeBlock, nullptr, nullptr, OpenSharedScope()});
+                        stack.push_back({node, 2});
+                        stack.push_back({children[1], 0});
+                    } else if (frame.stage == 2) {
+                        Branch &branch = branches.back();
+                        branch.thenValue = pop();
+                        branch.thenEnd = builder->GetInsertBlock();
+                        builder->CreateBr(branch.mergeBlock);
+                        CloseSharedScope(branch.scope);
+                        func->getBasicBlockList().push_back(branch.elseBlock);
+                        builder->SetInsertPoint(branch.elseBlock);
+                        stack.push_back({node, 3});
+                        stack.push_back({children[2], 0});
+                    } else {
+                        Branch branch = branches.back();
+                        branches.pop_back();
+                        Value *elseValue = pop();
+                        BasicBlock *elseEnd = builder->GetInsertBlock();
+                        builder->CreateBr(branch.mergeBlock);
+                        CloseSharedScope(branch.scope);
+                        func->getBasicBlockList().push_back(branch.mergeBlock);
+                        builder->SetInsertPoint(branch.mergeBlock);
+                        if (!branch.thenValue || !elseValue) {
+                            values.push_back(nullptr);
+                            break;
+                        }
+                        PHINode *phi = builder->CreatePHI(Type::getDoubleTy(*context), 2, "iftmp");
+                        phi->addIncoming(branch.thenValue, branch.thenEnd);
+                        phi->addIncoming(elseValue, elseEnd);
+                        values.push_back(phi);
+                    }
+                    break;
+                }
+                case Kind::ForKind: {
+                    // the children start, end, step and body
+                    const Index *children = &lists[first[node]];
+                    string_view name = symbols[payload[node]];
+                    Type *doubleType = Type::getDoubleTy(*context);
+                    if (frame.stage == 0) {
+                        stack.push_back({node, 1});
+                        stack.push_back({children[0], 0});
+                    } else if (frame.stage == 1) {
+                        Value *start = pop();
+                        if (!start) {
+                            values.push_back(nullptr);
+                            break;
+                        }
+                        BasicBlock *preheader = builder->GetInsertBlock();
+                        BasicBlock *loopBlock = BasicBlock::Create(*context, "loop", preheader->getParent());
+                        builder->CreateBr(loopBlock);
+                        builder->SetInsertPoint(loopBlock);
+                        PHINode *variable = builder->CreatePHI(doubleType, 2, name);
+                        variable->addIncoming(start, preheader);
+                        auto iter = symbolTable.find(name);
+                        Value *outer = iter != symbolTable.end() ? iter->second : nullptr;
+                        symbolTable[string(name)] = variable;
+                        loops.push_back({loopBlock, variable, outer, nullptr, OpenSharedScope(), false});
+                        stack.push_back({node, 2});
+                        stack.push_back({children[3], 0});
+                    } else if (frame.stage == 2) {
+                        loops.back().failed = !pop();
+                        stack.push_back({node, 3});
+                        if (children[2] != NoNode) {
+                            stack.push_back({children[2], 0});
+                        } else {
+                            values.push_back(ConstantFP::get(*context, APFloat(1.0)));
+                        }
+                    } else if (frame.stage == 3) {
+                        Loop &loop = loops.back();
+                        if (Value *step = pop()) {
+                            loop.next = builder->CreateFAdd(loop.variable, step, "nextvar");
+                        }
+                        stack.push_back({node, 4});
+                        stack.push_back({children[1], 0});
+                    } else {
+                        Loop loop = loops.back();
+                        loops.pop_back();
+                        Value *end = pop();
+                        bool failed = loop.failed || !loop.next || !end;
+                        BasicBlock *loopEnd = builder->GetInsertBlock();
+                        BasicBlock *afterBlock = BasicBlock::Create(*context, "afterloop", loopEnd->getParent());
+                        if (failed) {
+                            builder->CreateBr(afterBlock);
+                        } else {
+                            builder->CreateCondBr(ToCondition(end), loop.loopBlock, afterBlock);
+                            loop.variable->addIncoming(loop.next, loopEnd);
+                        }
+                        builder->SetInsertPoint(afterBlock);
+                        CloseSharedScope(loop.scope);
+                        if (loop.outer) {
+                            symbolTable[string(name)] = loop.outer;
+                        } else {
+                            symbolTable.erase(string(name));
+                        }
+                        values.push_back(failed ? nullptr : Constant::getNullValue(doubleType));
+                    }
+                    break;
+                }
+                default:
+                    values.push_back(nullptr);
+                    break;
+            }
+        }
+        return values.back();
+    }
+    
+    // Appends the subtree of the node, returns the index of the node. The
+    // children are appended first, with an explicit stack, then the node
+    // from the indices of its children.
+    Index Add(ASTNode *root)
+    {
+        struct Frame
+        {
+            ASTNode *node;  // nullptr for the missing step of a loop
+            bool expanded;
+        };
+        vector<Frame> stack{{root, false}};
+        vector<Index> indices;
+        SmallVector<ASTNode *, 8> children;
+        while (!stack.empty()) {
+            Frame frame = stack.back();
+            stack.pop_back();
+            ASTNode *node = frame.node;
+            if (!node) {
+                indices.push_back(NoNode);
+                continue;
+            }
+            if (!frame.expanded && node->kind == Kind::BinaryKind && static_cast<BinaryExprAST *>(node)->shared) {
+                // a shared node stays one node
+                auto iter = sharedIndices.find(node);
+                if (iter != sharedIndices.end()) {
+                    indices.push_back(iter->second);
+                    continue;
+                }
+            }
+            GetChildren(node, children);
+            if (!frame.expanded && !children.empty()) {
+                stack.push_back({node, true});
+                for (size_t idx = children.size(); idx > 0; --idx) {
+                    stack.push_back({children[idx - 1], false});
+                }
+                continue;
+            }
+            size_t start = indices.size() - children.size();
+            Index index = NewNode(node, indices.data() + start);
+            indices.resize(start);
+            indices.push_back(index);
+        }
+        return indices.back();
+    }
+
+    // The children Add appends before the node, in order.
+    static void GetChildren(ASTNode *node, SmallVectorImpl<ASTNode *> &children)
+    {
+        children.clear();
+        switch (node->kind) {
+            case Kind::BinaryKind: {
+                auto *binary = static_cast<BinaryExprAST *>(node);
+                children.append({binary->left, binary->right});
+                break;
+            }
+            case Kind::CallKind: {
+                auto *call = static_cast<CallExprAST *>(node);
+                children.append(call->args.begin(), call->args.end());
+                break;
+            }
+            case Kind::IfKind: {
+                auto *ifExpr = static_cast<IfExprAST *>(node);
+                children.append({ifExpr->cond, ifExpr->thenExpr, ifExpr->elseExpr});
+                break;
+            }
+            case Kind::ForKind: {
+                auto *forExpr = static_cast<ForExprAST *>(node);
+                children.append({forExpr->start, forExpr->end, forExpr->step, forExpr->body});
+                break;
+            }
+            case Kind::FunctionKind: {
+                auto *func = static_cast<FunctionAST *>(node);
+                children.append({func->prototype, func->body});
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // Appends the node, 'children' are the indices of what GetChildren gave.
+    Index NewNode(ASTNode *node, const Index *children)
+    {
+        switch (node->kind) {
+            case Kind::NumberKind: {
+                constants.push_back(static_cast<NumberExprAST *>(node)->value);
+                return NewNode(node->kind, static_cast<Index>(constants.size() - 1), 0, 0);
+            }
+            case Kind::VariableKind:
+                return NewNode(node->kind, Symbol(static_cast<VariableExprAST *>(node)->variable), 0, 0);
+            case Kind::BinaryKind: {
+                auto *binary = static_cast<BinaryExprAST *>(node);
+                Index index = NewNode(node->kind, static_cast<unsigned char>(binary->op), children[0], children[1]);
+                if (binary->shared) {
+                    shared[index] = true;
+                    sharedIndices.emplace(binary, index);
+                }
+                return index;
+            }
+            case Kind::CallKind: {
+                auto *call = static_cast<CallExprAST *>(node);
+                Index start = static_cast<Index>(lists.size());
+                lists.insert(lists.end(), children, children + call->args.size());
+                return NewNode(node->kind, Symbol(call->callee), start, static_cast<Index>(call->args.size()));
+            }
+            case Kind::IfKind: {
+                Index start = static_cast<Index>(lists.size());
+                lists.insert(lists.end(), children, children + 3);
+                return NewNode(node->kind, 0, start, 3);
+            }
+            case Kind::ForKind: {
+                Index start = static_cast<Index>(lists.size());
+                lists.insert(lists.end(), children, children + 4);
+                return NewNode(node->kind, Symbol(static_cast<ForExprAST *>(node)->variable), start, 4);
+            }
+            case Kind::PrototypeKind: {
+                auto *proto = static_cast<PrototypeAST *>(node);
+                Index start = static_cast<Index>(lists.size());
+                for (auto arg: proto->args) {
+                    lists.push_back(Symbol(arg));
+                }
+                return NewNode(node->kind, Symbol(proto->name), start, static_cast<Index>(proto->args.size()));
+            }
+            case Kind::FunctionKind:
+                return NewNode(node->kind, children[0], children[1], 0);
+        }
+        return 0;
+    }
+
+    Index NewNode(Kind kind, uint32_t data, Index lhs, Index rhs)
+    {
+        kinds.push_back(kind);
+        payload.push_back(data);
+        first.push_back(lhs);
+        second.push_back(rhs);
+        shared.push_back(false);
+        return static_cast<Index>(kinds.size() - 1);
+    }
+
+    Index Symbol(string_view name)
+    {
+        auto iter = symbolIds.find(name);
+        if (iter != symbolIds.end()) {
+            return iter->second;
+        }
+        Index id = static_cast<Index>(symbols.size());
+        symbols.push_back(name);
+        symbolIds.emplace(name, id);
+        return id;
+    }
+
+    // one entry per node:
+    //            payload           first                  second
+    // Number     constant          -                      -
+    // Variable   symbol            -                      -
+    // Binary     operator          left child             right child
+    // Call       callee symbol     first argument (lists) number of arguments
+    // If         -                 cond, then, else       3
+    //                              (lists)
+    // For        variable symbol   start, end, step, body 4
+    //                              (lists)
+    // Prototype  name symbol       first argument (lists) number of arguments
+    // Function   prototype node    body node              -
+    vector<uint8_t> kinds;
+    vector<uint32_t> payload;
+    vector<Index> first;
+    vector<Index> second;
+    vector<bool> shared;  // emitted once per function, see NodeTable
+
+    vector<double> constants;
+    vector<string_view> symbols;
+    unordered_map<string_view, Index> symbolIds;
+    vector<Index> lists;  // children of calls, ifs and loops, argument symbols of prototypes
+    vector<Index> roots;  // the toplevel nodes
+    unordered_map<const ASTNode *, Index> sharedIndices;  // only while building
+};
+
+};
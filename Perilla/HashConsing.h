@@ -0,0 +1,138 @@
+#pragma once
+
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include "AST.h"
+#include "Arena.h"
+
+using namespace std;
+
+namespace Perilla {
+
+// Builds the expression nodes of the parser so that structurally equal pure
+// subtrees are one node. Numbers and variables are looked up by value and
+// name, a binary node by its operator and the addresses of its children,
+// which are unique already; the operands of + and * in either order. Calls
+// may have side effects, neither they nor the nodes above them are shared.
+// A binary node used a second time is marked shared, and its value is only
+// emitted once per function. A loop variable is another variable than the
+// one of the same name outside the loop, it gets nodes of its own.
+class NodeTable
+{
+public:
+    NodeTable(): sharedNodes(0) {}
+
+    NumberExprAST *Number(Arena &arena, double value)
+    {
+        // by the bits, 0 and -0 differ
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        auto iter = numbers.find(bits);
+        if (iter != numbers.end()) {
+            sharedNodes++;
+            return iter->second;
+        }
+        auto *node = arena.New<NumberExprAST>(value);
+        numbers.emplace(bits, node);
+        pure.insert(node);
+        return node;
+    }
+
+    VariableExprAST *Variable(Arena &arena, string_view name)
+    {
+        auto iter = variables.find(name);
+        if (iter != variables.end()) {
+            sharedNodes++;
+            return iter->second;
+        }
+        auto *node = arena.New<VariableExprAST>(arena.NewString(name));
+        variables.emplace(node->variable, node);
+        pure.insert(node);
+        return node;
+    }
+
+    // The variable 'name' is bound by a loop until Unbind.
+    void Bind(string_view name)
+    {
+        auto iter = variables.find(name);
+        bindings.emplace_back(name, iter != variables.end() ? iter->second : nullptr);
+        variables.erase(name);
+    }
+
+    void Unbind()
+    {
+        auto [name, outer] = bindings.back();
+        bindings.pop_back();
+        if (outer) {
+            variables[name] = outer;
+        } else {
+            variables.erase(name);
+        }
+    }
+
+    BinaryExprAST *Binary(Arena &arena, char op, ExprAST *lhs, ExprAST *rhs)
+    {
+        if (!pure.count(lhs) || !pure.count(rhs)) {
+            return arena.New<BinaryExprAST>(op, lhs, rhs);
+        }
+        // + and * commute exactly, x + 3 is 3 + x
+        BinaryKey key{op, lhs, rhs};
+        if ((op == '+' || op == '*') && less<ExprAST *>()(rhs, lhs)) {
+            swap(key.lhs, key.rhs);
+        }
+        auto iter = binaries.find(key);
+        if (iter != binaries.end()) {
+            sharedNodes++;
+            iter->second->shared = true;
+            return iter->second;
+        }
+        auto *node = arena.New<BinaryExprAST>(op, lhs, rhs);
+        binaries.emplace(key, node);
+        pure.insert(node);
+        return node;
+    }
+
+    // the nodes that were not allocated because an equal one existed
+    size_t GetSharedNodes() const
+    {
+        return sharedNodes;
+    }
+
+private:
+    struct BinaryKey
+    {
+        char op;
+        ExprAST *lhs;
+        ExprAST *rhs;
+
+        bool operator==(const BinaryKey &other) const
+        {
+            return op == other.op && lhs == other.lhs && rhs == other.rhs;
+        }
+    };
+
+    struct BinaryHash
+    {
+        size_t operator()(const BinaryKey &key) const
+        {
+            size_t hash = std::hash<ExprAST *>()(key.lhs);
+            hash ^= std::hash<ExprAST *>()(key.rhs) + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+            return hash ^ static_cast<unsigned char>(key.op);
+        }
+    };
+
+    unordered_map<uint64_t, NumberExprAST *> numbers;
+    unordered_map<string_view, VariableExprAST *> variables;
+    unordered_map<BinaryKey, BinaryExprAST *, BinaryHash> binaries;
+    unordered_set<const ExprAST *> pure;  // the nodes in the tables
+    vector<pair<string_view, VariableExprAST *>> bindings;  // the loop variables and the nodes they hide
+    size_t sharedNodes;
+};
+
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <initializer_list>
+#include "Arena.h"
+
+using namespace std;
+
+namespace Perilla {
+
+// Maps every distinct identifier to a small integer id. The names are
+// copied once into an arena, so looking up a known identifier does not
+// allocate and the views handed out stay valid as long as the interner.
+class Interner
+{
+public:
+    // the keywords are interned first, so they have fixed ids
+    static const uint32_t DefId = 0;
+    static const uint32_t ExternId = 1;
+    static const uint32_t IfId = 2;
+    static const uint32_t ThenId = 3;
+    static const uint32_t ElseId = 4;
+    static const uint32_t ForId = 5;
+    static const uint32_t InId = 6;
+
+    Interner()
+    {
+        for (const char *keyword: {"def", "extern", "if", "then", "else", "for", "in"}) {
+            Intern(keyword);
+        }
+    }
+
+    Interner(const Interner&) = delete;
+    Interner& operator=(const Interner&) = delete;
+
+    uint32_t Intern(string_view name)
+    {
+        auto iter = ids.find(name);
+        if (iter != ids.end()) {
+            return iter->second;
+        }
+
+        string_view stored = Store(name);
+        uint32_t id = static_cast<uint32_t>(names.size());
+        names.push_back(stored);
+        ids.emplace(stored, id);
+        return id;
+    }
+
+    string_view GetName(uint32_t id) const
+    {
+        return names[id];
+    }
+
+    size_t Size() const
+    {
+        return names.size();
+    }
+
+    size_t GetBytesAllocated() const
+    {
+        return arena.GetBytesAllocated();
+    }
+
+    // Copies the text into the arena without interning it.
+    string_view Store(string_view text)
+    {
+        return arena.NewString(text);
+    }
+
+private:
+    unordered_map<string_view, uint32_t> ids;
+    vector<string_view> names;
+    Arena arena;
+};
+
+};
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <iostream>
+
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/TargetSelect.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+// A thin wrapper of ORC LLJIT. Every compiled module is added to the main
+// JITDylib, symbols that can not be found in there (the 'extern' prototypes
+// without a host function defined up front) are resolved against the
+// symbols of the host process.
+class PerillaJIT
+{
+public:
+    using ResourceTrackerPtr = orc::ResourceTrackerSP;
+
+    // With compileThreads > 0 the modules are compiled on a pool of that
+    // many threads, so that a lookup needing several modules compiles them
+    // concurrently. With a cache, the compiled objects are stored in it and
+    // taken from it instead of compiling again.
+    static unique_ptr<PerillaJIT> Create(unsigned compileThreads = 0, ObjectCache *cache = nullptr)
+    {
+        static bool targetInitialized = InitializeTarget();
+        if (!targetInitialized) {
+            cout << "Failed to initialize native target" << endl;
+            return nullptr;
+        }
+
+        orc::LLJITBuilder builder;
+        builder.setNumCompileThreads(compileThreads);
+        if (cache) {
+            builder.setCompileFunctionCreator([cache, compileThreads](orc::JITTargetMachineBuilder machineBuilder)
+                -> Expected<unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+                if (compileThreads > 0) {
+                    return make_unique<orc::ConcurrentIRCompiler>(move(machineBuilder), cache);
+                }
+                auto machine = machineBuilder.createTargetMachine();
+                if (!machine) {
+                    return machine.takeError();
+                }
+                return make_unique<orc::TMOwningSimpleCompiler>(move(*machine), cache);
+            });
+        }
+        auto jit = builder.create();
+        if (!jit) {
+            LogError(jit.takeError());
+            return nullptr;
+        }
+
+        auto &mainLib = (*jit)->getMainJITDylib();
+        auto generator = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            (*jit)->getDataLayout().getGlobalPrefix());
+        if (!generator) {
+            LogError(generator.takeError());
+            return nullptr;
+        }
+        mainLib.addGenerator(move(*generator));
+
+        return unique_ptr<PerillaJIT>(new PerillaJIT(move(*jit)));
+    }
+
+    const DataLayout &GetDataLayout() const
+    {
+        return jit->getDataLayout();
+    }
+
+    const Triple &GetTargetTriple() const
+    {
+        return jit->getTargetTriple();
+    }
+
+    ResourceTrackerPtr CreateResourceTracker()
+    {
+        return jit->getMainJITDylib().createResourceTracker();
+    }
+
+    // Hand the module over to the JIT, it will be compiled lazily on the
+    // first lookup of one of its symbols.
+    bool AddModule(unique_ptr<Module> module, unique_ptr<LLVMContext> context,
+                   ResourceTrackerPtr tracker = nullptr)
+    {
+        orc::ThreadSafeModule tsm(move(module), move(context));
+        Error err = tracker ? jit->addIRModule(tracker, move(tsm))
+                            : jit->addIRModule(move(tsm));
+        if (err) {
+            LogError(move(err));
+            return false;
+        }
+        return true;
+    }
+
+    // Defines 'name' as the host function at 'address', the modules calling
+    // it are linked against that instead of looking it up in the process.
+    bool DefineHostFunction(const string &name, uint64_t address)
+    {
+        JITEvaluatedSymbol symbol(address, JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+        Error err = jit->getMainJITDylib().define(orc::absoluteSymbols({{jit->mangleAndIntern(name), symbol}}));
+        if (err) {
+            LogError(move(err));
+            return false;
+        }
+        return true;
+    }
+
+    // Returns the address of the compiled symbol, 0 if it can not be found.
+    uint64_t Lookup(const string &name)
+    {
+        auto symbol = jit->lookup(name);
+        if (!symbol) {
+            LogError(symbol.takeError());
+            return 0;
+        }
+        return symbol->getAddress();
+    }
+
+    bool Remove(ResourceTrackerPtr tracker)
+    {
+        if (Error err = tracker->remove()) {
+            LogError(move(err));
+            return false;
+        }
+        return true;
+    }
+
+private:
+    PerillaJIT(unique_ptr<orc::LLJIT> lljit): jit(move(lljit)) {}
+
+    static bool InitializeTarget()
+    {
+        return !InitializeNativeTarget() && !InitializeNativeTargetAsmPrinter();
+    }
+
+    static void LogError(Error err)
+    {
+        cout << "JIT error: " << toString(move(err)) << endl;
+    }
+
+    unique_ptr<orc::LLJIT> jit;
+};
+
+};
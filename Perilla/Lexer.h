@@ -4,10 +4,22 @@
 #include <string>
 #include <memory>
 #include <vector>
-#include <deque>
 #include <cctype>
+#include <cstring>
 #include <exception>
+#include <string_view>
+#include <cstdlib>
+#include <clocale>
+#include <locale.h>
+#include <charconv>
+#include <system_error>
 #include "Token.h"
+#include "Interner.h"
+#include "Scanner.h"
+
+#if defined(__APPLE__)
+#include <xlocale.h>
+#endif
 
 using namespace std;
 
@@ -16,129 +28,139 @@ namespace Perilla {
 class Lexer
 {
 public:
-    Lexer(): current() {}
+    Lexer(): cursor(nullptr), limit(nullptr), chunk(nullptr), offset(0), line(1), lineStart(0),
+        token(Token::EofToken) {}
     virtual ~Lexer() = default;
+
+    // Hands out the next contiguous chunk of the source as [begin, end).
+    // Returns false once the source is exhausted. Tokens are views into the
+    // chunks, so the chunks need to stay valid as long as the lexer.
+    virtual bool Refill(const char *&begin, const char *&end) = 0;
     
-    void Reset()
+    // The whole source if it's in memory at once, empty otherwise. Lets the
+    // source be split and lexed in parts by other lexers.
+    virtual string_view GetSource() const
     {
-        tokens.clear();
+        return string_view();
     }
 
-    virtual char Next() = 0;
-    virtual bool Eof() const = 0;
-
     Token NextToken()
     {
-        if (!current.valid) {
-            if (!GetCurrent()) {
-                return Token::EofToken;
+        while (Available()) {
+            if (Parse()) {
+                return token;
             }
         }
-        
-        while (current.valid && tokens.empty()) {
-            Parse();
+        return Token::EofToken;
+    }
+    
+    const Interner &GetInterner() const
+    {
+        return interner;
+    }
+    
+    // number of bytes of the source lexed so far
+    size_t GetBytesLexed() const
+    {
+        return Position();
+    }
+    
+    // Converts a number validated by ParseNumber straight from the source.
+    // from_chars is correctly rounded and locale independent, the result is
+    // bit-identical to stod. Out of range values, and all values where the
+    // library has no from_chars for doubles, are left to strtod in the "C"
+    // locale, which gives inf/denormals where stod would throw.
+    static double ToDouble(string_view number)
+    {
+#if defined(__cpp_lib_to_chars)
+        double value = 0;
+        auto result = from_chars(number.data(), number.data() + number.size(), value);
+        if (result.ec == errc()) {
+            return value;
         }
-        
-        if (tokens.empty()) {
-            return Token::EofToken;
+#endif
+        // strtod needs a terminated string, numbers are short
+        char buffer[64];
+        if (number.size() < sizeof(buffer)) {
+            memcpy(buffer, number.data(), number.size());
+            buffer[number.size()] = '\0';
+            return StrToDouble(buffer);
         }
-
-        Token front = tokens.front();
-        tokens.pop_front();
-        return front;
+        return StrToDouble(string(number).c_str());
     }
 
 private:
-    struct CharRef
+    // Make sure there is at least one character at the cursor.
+    inline bool Available()
     {
-        bool valid;
-        size_t line;
-        size_t column;
-        char current;
-        
-        CharRef(): valid(false) {}
-
-        CharRef& operator=(char ch)
-        {
-            current = ch;
-            if (!valid) {
-                line = 1;
-                column = 1;
-                valid = true;
-            } else if (ch == '\n') {
-                line++;
-                column = 1;
-            } else {
-                column++;
-            }
-            
-            return *this;
-        }
-        
-        bool operator==(char ch)
-        {
-            return valid && current == ch;
-        }
-        
-        bool operator==(const CharRef& rhs)
-        {
-            return valid && rhs.valid && current == rhs.current &&
-                    line == rhs.line && column == rhs.column;
-        }
-        
-        operator char() const
-        {
-            return current;
-        }
-        
-        void Reset()
-        {
-            valid = false;
-        }
-    };
-
-    inline bool GetCurrent()
+        return cursor < limit || Fill();
+    }
+    
+    bool Fill()
     {
-        if (!Eof()) {
-            current = Next();
+        const char *begin = nullptr;
+        const char *end = nullptr;
+        while (Refill(begin, end)) {
+            if (begin == end) {
+                continue;  // skip empty chunks
+            }
+            offset += limit - chunk;
+            chunk = cursor = begin;
+            limit = end;
             return true;
         }
-        current.Reset();
+        offset += limit - chunk;
+        chunk = cursor = limit = nullptr;
         return false;
     }
     
-    void Parse()
+    // Returns true if a token is produced
+    bool Parse()
     {
-        while (isspace(current)) {
-            if (!GetCurrent()) {
-                return;
+        // skip whitespaces, they are the only place line breaks show up
+        do {
+            size_t lines = 0;
+            const char *lastBreak = nullptr;
+            cursor = Scanner::SkipSpaces(cursor, limit, lines, lastBreak);
+            if (lines) {
+                line += lines;
+                lineStart = offset + (lastBreak - chunk) + 1;
             }
+        } while (cursor == limit && Fill());
+        
+        if (cursor == limit) {
+            return false;
         }
 
-        if (isalpha(current)) {
+        char ch = *cursor;
+        if (isalpha(static_cast<unsigned char>(ch))) {
             ParseIdent();
-        } else if (current == '-' || isnumber(current)) {
+        } else if (ch == '-' || isdigit(static_cast<unsigned char>(ch))) {
             ParseNumber();
-        } else if (current == '#') {
+        } else if (ch == '#') {
             ParseComment();
+            return false;
         } else {
             ParseUnknown();
         }
+        return true;
     }
     
     void ParseIdent()
     {
-        string buffer(1, current);
-        while (!Eof() && GetCurrent() && isalnum(current)) {
-            buffer += current;
-        }
+        string_view name = Scan(Scanner::SkipAlnum);
         
-        if (buffer == "def") {
-            tokens.push_back(Token::DefToken);
-        } else if (buffer == "extern") {
-            tokens.push_back(Token::ExternToken);
+        uint32_t id = interner.Intern(name);
+        if (id == Interner::DefId) {
+            token = Token::DefToken;
+        } else if (id == Interner::ExternId) {
+            token = Token::ExternToken;
+        } else if (id <= Interner::InId) {
+            static const Token *controls[] = {&Token::IfToken, &Token::ThenToken, &Token::ElseToken,
+                                              &Token::ForToken, &Token::InToken};
+            token = *controls[id - Interner::IfId];
         } else {
-            tokens.push_back(Token{Token::Type::Ident, buffer});
+            token = Token{Token::Type::Ident, interner.GetName(id), id};
         }
     }
     
@@ -156,105 +178,191 @@ private:
             {-1, -1, -1, -1,  8,  8},  // 7: just after '+/-' in exponential part
             {-1, -1, -1, -1,  8,  8}   // 8: terminal, in exponential part
         };
-        
-//        char previous = current;
-//        if (!GetCurrent() || transformTable[0][]) {
-//            if (isdigit(previous)) {
-//                tokens.push_back(Token{Token::Type::Number, string(1, previous)});
-//            } else {
-//                // '-' not part of the number
-//                tokens.push_back(Token {previous});
-//            }
-//            return;
-//        }
 
-        string buffer;
         short state = 0; // initial state
-        while (CurrentValidInNumber()) {
-            int inputType = -1;
-            switch (current) {
-                case '+': inputType = 0; break;
-                case '-': inputType = 1; break;
-                case '.': inputType = 2; break;
-                case 'e':
-                case 'E': inputType = 3; break;
-                case '0': inputType = 4; break;
-                default: inputType = 5; break;
-            }
-            state = transformTable[state][inputType];
-            if (state == -1) { // valid number
-                break;
+        string_view number = Scan([&state](const char *p, const char *end) {
+            for (; p < end; ++p) {
+                if (state == 3 || state == 6 || state == 8) {
+                    // runs of digits don't change the state
+                    p = Scanner::SkipDigits(p, end);
+                    if (p == end) {
+                        break;
+                    }
+                }
+                int inputType = NumberInputType(*p);
+                short next = inputType == -1 ? -1 : transformTable[state][inputType];
+                if (next == -1) { // end of the number
+                    break;
+                }
+                state = next;
             }
-            
-            buffer += current;
-            GetCurrent();
-        }
+            return p;
+        });
         
-        if (buffer == "-" && state == 1) {
+        if (state == 1) {
             // only '-'
-            tokens.push_back(Token{'-'});
+            token = Token{'-'};
             return;
         }
 
-//        if (state == -1 || state == 0 || state == 1 || state == 4 || state == 5 || state == 7) {
+//        if (state == 0 || state == 1 || state == 4 || state == 5 || state == 7) {
 //            // TODO error number
 //            HandlerError("invalid number");
 //        }
 
-        tokens.push_back(Token{Token::Type::Number, buffer});
+        if (number.data() == spill.data()) {
+            // the number spans chunks, keep the text with the lexer
+            number = interner.Store(number);
+        }
+        token = Token{Token::Type::Number, number, ToDouble(number)};
     }
     
     void ParseComment()
     {
-        // only support single line comment
-        while (!Eof() && current != '\n') {
-            GetCurrent();
-        }
-        
-        GetCurrent();  // skip \n
-        Parse();
+        // only support single line comment, stop at the '\n' so that the
+        // line break is accounted when skipping whitespaces
+        do {
+            cursor = Scanner::FindLineEnd(cursor, limit);
+            if (cursor < limit) {
+                return;
+            }
+        } while (Fill());
     }
     
     void ParseUnknown()
     {
-        tokens.push_back(Token{current});
-        GetCurrent(); // skip the character
+        token = Token{*cursor};
+        ++cursor; // skip the character
+    }
+    
+    // Advances the cursor to advance(cursor, limit), which returns where the
+    // token stops, or limit if it may continue in the next chunk. Returns the
+    // scanned text, a view into the chunk, or into 'spill' if it spans chunks.
+    template<typename Advance>
+    string_view Scan(Advance advance)
+    {
+        const char *start = cursor;
+        cursor = advance(cursor, limit);
+        if (cursor < limit) {
+            return string_view(start, cursor - start);
+        }
+        
+        spill.assign(start, cursor);
+        while (Fill()) {
+            start = cursor;
+            cursor = advance(cursor, limit);
+            spill.append(start, cursor);
+            if (cursor < limit) {
+                break;
+            }
+        }
+        return spill;
     }
     
     void HandlerError(string errorMessage)
     {
-        cout << "at line " << current.line << " col " << current.column << ": "
+        cout << "at line " << line << " col " << Position() - lineStart + 1 << ": "
             << errorMessage << endl;
     }
     
-    inline bool CurrentValidInNumber() const {
-        return  (current == '+' || current == '-' || current == '.' ||
-                 current == 'e' || current == 'E' || std::isdigit(current) != 0);
+    // offset of the cursor from the beginning of the source
+    inline size_t Position() const
+    {
+        return offset + (cursor - chunk);
+    }
+    
+    // strtod in the "C" locale, the decimal point of the current locale may
+    // not be '.'
+    static double StrToDouble(const char *text)
+    {
+#if defined(_WIN32)
+        static const _locale_t cLocale = _create_locale(LC_ALL, "C");
+        return _strtod_l(text, nullptr, cLocale);
+#else
+        static const locale_t cLocale = newlocale(LC_ALL_MASK, "C", static_cast<locale_t>(0));
+        return strtod_l(text, nullptr, cLocale);
+#endif
+    }
+    
+    // column of the character in the transform table of ParseNumber
+    static inline int NumberInputType(char ch)
+    {
+        switch (ch) {
+            case '+': return 0;
+            case '-': return 1;
+            case '.': return 2;
+            case 'e':
+            case 'E': return 3;
+            case '0': return 4;
+            default: return isdigit(static_cast<unsigned char>(ch)) ? 5 : -1;
+        }
     }
 
-    CharRef current;
-    deque<Token> tokens;
+    const char *cursor;
+    const char *limit;
+    const char *chunk;   // beginning of the current chunk
+    size_t offset;       // offset of the current chunk in the source
+    size_t line;
+    size_t lineStart;    // offset of the first character in the line
+    Token token;         // the token produced by Parse
+    string spill;        // text of the last token spanning chunks
+    Interner interner;
 };
 
 class StringLexer: public Lexer
 {
 public:
-    StringLexer(string src): source(move(src)), pos(0) {}
+    StringLexer(string src): source(move(src)), consumed(false) {}
     virtual ~StringLexer() = default;
 
-    inline char Next() override
+    // the whole source is a single chunk
+    bool Refill(const char *&begin, const char *&end) override
     {
-        return source[pos++];
+        if (consumed) {
+            return false;
+        }
+        consumed = true;
+        begin = source.data();
+        end = begin + source.size();
+        return true;
     }
     
-    inline bool Eof() const override
+    string_view GetSource() const override
     {
-        return pos >= source.size();
+        return source;
     }
     
 private:
     string source;
-    size_t pos;
+    bool consumed;
+};
+
+// Lexes a source owned by someone else, which must outlive the lexer.
+class ViewLexer: public Lexer
+{
+public:
+    ViewLexer(string_view src): source(src), consumed(false) {}
+    virtual ~ViewLexer() = default;
+
+    bool Refill(const char *&begin, const char *&end) override
+    {
+        if (consumed) {
+            return false;
+        }
+        consumed = true;
+        begin = source.data();
+        end = begin + source.size();
+        return true;
+    }
+    
+    string_view GetSource() const override
+    {
+        return source;
+    }
+    
+private:
+    string_view source;
+    bool consumed;
 };
 
 };
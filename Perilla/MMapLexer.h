@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Lexer.h"
+
+using namespace std;
+
+namespace Perilla {
+
+// Lexes a file straight from a read-only memory mapping, so that large
+// sources are neither read nor copied into memory before lexing.
+class MMapLexer: public Lexer
+{
+public:
+    MMapLexer(const string &path): data(nullptr), size(0), consumed(false), opened(false)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            HandleError(path, "cannot open file");
+            return;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) == -1) {
+            HandleError(path, "cannot stat file");
+            close(fd);
+            return;
+        }
+
+        // mapping an empty file fails, and there is nothing to lex anyway
+        if (info.st_size > 0) {
+            void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                HandleError(path, "cannot map file");
+            } else {
+                data = static_cast<const char *>(mapping);
+                size = static_cast<size_t>(info.st_size);
+                // the source is read once from the front to the end
+                madvise(mapping, size, MADV_SEQUENTIAL);
+                opened = true;
+            }
+        } else {
+            opened = true;
+        }
+        close(fd);  // the mapping stays valid after closing
+    }
+
+    MMapLexer(const MMapLexer&) = delete;
+    MMapLexer& operator=(const MMapLexer&) = delete;
+
+    virtual ~MMapLexer()
+    {
+        if (data) {
+            munmap(const_cast<char *>(data), size);
+        }
+    }
+
+    // the whole mapping is a single chunk
+    bool Refill(const char *&begin, const char *&end) override
+    {
+        if (consumed || !data) {
+            return false;
+        }
+        consumed = true;
+        begin = data;
+        end = data + size;
+        return true;
+    }
+
+    string_view GetSource() const override
+    {
+        return string_view(data, size);
+    }
+
+    inline bool IsOpen() const
+    {
+        return opened;
+    }
+
+private:
+    void HandleError(const string &path, const string &errorMessage)
+    {
+        cout << path << ": " << errorMessage << " (" << strerror(errno) << ")" << endl;
+    }
+
+    const char *data;
+    size_t size;
+    bool consumed;
+    bool opened;
+};
+
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include "AST.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+// The results of one pure function by the bits of its arguments, so 0 and
+// -0 are different keys and a NaN argument is found again. The table has a
+// fixed number of entries and a key only goes into one of them, a new
+// result replaces whatever was there. The entries are guarded by a few
+// locks, picked by the entry, so the compiled code may call the function
+// from several threads.
+class MemoTable
+{
+public:
+    MemoTable(string name, size_t argCount, size_t capacity)
+    : name(move(name)), argCount(argCount), mask(RoundUp(capacity) - 1), keys((mask + 1) * argCount),
+      values(mask + 1), valid(mask + 1, 0), used(0), hits(0), misses(0) {}
+
+    // Called by the compiled code, copies the result for 'args' to 'result'
+    // and returns 1 when it's in the table.
+    static int32_t Lookup(MemoTable *table, const double *args, double *result)
+    {
+        size_t entry = table->Hash(args) & table->mask;
+        lock_guard<mutex> lock(table->locks[entry % LockCount]);
+        if (table->valid[entry] && table->SameKey(entry, args)) {
+            *result = table->values[entry];
+            table->hits.fetch_add(1, memory_order_relaxed);
+            return 1;
+        }
+        table->misses.fetch_add(1, memory_order_relaxed);
+        return 0;
+    }
+
+    static void Store(MemoTable *table, const double *args, double result)
+    {
+        size_t entry = table->Hash(args) & table->mask;
+        lock_guard<mutex> lock(table->locks[entry % LockCount]);
+        if (!table->valid[entry]) {
+            table->valid[entry] = 1;
+            table->used.fetch_add(1, memory_order_relaxed);
+        }
+        if (table->argCount) {
+            memcpy(table->keys.data() + entry * table->argCount, args, table->argCount * sizeof(double));
+        }
+        table->values[entry] = result;
+    }
+
+    const string &GetName() const
+    {
+        return name;
+    }
+
+    size_t GetArgCount() const
+    {
+        return argCount;
+    }
+
+    uint64_t GetHits() const
+    {
+        return hits.load(memory_order_relaxed);
+    }
+
+    uint64_t GetMisses() const
+    {
+        return misses.load(memory_order_relaxed);
+    }
+
+    string GetString() const
+    {
+        return name + ": " + to_string(GetHits()) + " hits, " + to_string(GetMisses()) + " misses, " +
+            to_string(used.load(memory_order_relaxed)) + " of " + to_string(mask + 1) + " entries used";
+    }
+
+    string GetJSON() const
+    {
+        return "{\"name\": \"" + name + "\", \"hits\": " + to_string(GetHits()) + ", \"misses\": " +
+            to_string(GetMisses()) + ", \"used\": " + to_string(used.load(memory_order_relaxed)) +
+            ", \"entries\": " + to_string(mask + 1) + "}";
+    }
+
+private:
+    static constexpr size_t LockCount = 64;
+
+    static size_t RoundUp(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    // The keys of a nullary definition are empty, every entry matches.
+    bool SameKey(size_t entry, const double *args) const
+    {
+        return argCount == 0 ||
+            memcmp(keys.data() + entry * argCount, args, argCount * sizeof(double)) == 0;
+    }
+
+    size_t Hash(const double *args) const
+    {
+        uint64_t hash = 0x9e3779b97f4a7c15ull;
+        for (size_t idx = 0; idx < argCount; ++idx) {
+            uint64_t bits;
+            memcpy(&bits, &args[idx], sizeof(bits));
+            // the finalizer of splitmix64
+            hash ^= bits;
+            hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+            hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+            hash ^= hash >> 31;
+        }
+        return static_cast<size_t>(hash);
+    }
+
+    string name;
+    size_t argCount;
+    size_t mask;
+    vector<uint64_t> keys;  // argCount bit patterns per entry
+    vector<double> values;
+    vector<uint8_t> valid;
+    array<mutex, LockCount> locks;
+    atomic<size_t> used;
+    atomic<uint64_t> hits;
+    atomic<uint64_t> misses;
+};
+
+// Emits a memoized definition 'foo' into the current module. The body goes
+// into the internal 'foo.body', and 'foo' looks the arguments up in 'table'
+// before calling it and stores the result after. Recursive calls go to 'foo'
+// and so through the table too. The address of the table is a constant in
+// the code, the module must not be cached. Only correct for a definition
+// the PurityAnalysis proves pure.
+Function *EmitMemoized(FunctionAST &def, MemoTable &table)
+{
+    PrototypeAST *proto = def.prototype;
+    string name(proto->name);
+    Function *func = module->getFunction(name);
+    if (!func) {
+        func = DeclareFunction(name, vector<string>(proto->args.begin(), proto->args.end()));
+    }
+    if (!func->empty()) {
+        return (Function*)LogErrorV("Function cannot be redefined");
+    }
+    Function *body = Function::Create(func->getFunctionType(), Function::InternalLinkage, name + ".body",
+                                      module.get());
+    size_t idx = 0;
+    for (auto &arg: body->args()) {
+        arg.setName(proto->args[idx++]);
+    }
+    if (!EmitFunction(body, [&def]() { return def.body->CodeGen(); })) {
+        return nullptr;
+    }
+
+    Type *doubleType = Type::getDoubleTy(*context);
+    Type *int32Type = Type::getInt32Ty(*context);
+    Type *int64Type = Type::getInt64Ty(*context);
+    Type *pointerType = PointerType::getUnqual(doubleType);
+    auto address = [int64Type](Type *type, const void *pointer) {
+        return ConstantExpr::getIntToPtr(ConstantInt::get(int64Type, reinterpret_cast<uint64_t>(pointer)), type);
+    };
+    Value *tableAddress = ConstantInt::get(int64Type, reinterpret_cast<uint64_t>(&table));
+
+    BasicBlock *entry = BasicBlock::Create(*context, "entry", func);
+    BasicBlock *hit = BasicBlock::Create(*context, "hit", func);
+    BasicBlock *miss = BasicBlock::Create(*context, "miss", func);
+    builder->SetInsertPoint(entry);
+    ArrayType *argsType = ArrayType::get(doubleType, max<size_t>(func->arg_size(), 1));
+    Value *args = builder->CreateAlloca(argsType, nullptr, "args");
+    Value *result = builder->CreateAlloca(doubleType, nullptr, "result");
+    SmallVector<Value *, 8> values;
+    for (auto &arg: func->args()) {
+        builder->CreateStore(&arg, builder->CreateConstInBoundsGEP2_32(argsType, args, 0, arg.getArgNo()));
+        values.push_back(&arg);
+    }
+    Value *argsPointer = builder->CreateConstInBoundsGEP2_32(argsType, args, 0, 0);
+
+    FunctionType *lookupType = FunctionType::get(int32Type, {int64Type, pointerType, pointerType}, false);
+    Value *found = builder->CreateCall(lookupType,
+                                       address(PointerType::getUnqual(lookupType),
+                                               reinterpret_cast<void *>(&MemoTable::Lookup)),
+                                       {tableAddress, argsPointer, result}, "found");
+    builder->CreateCondBr(builder->CreateICmpNE(found, ConstantInt::get(int32Type, 0)), hit, miss);
+
+    builder->SetInsertPoint(hit);
+    builder->CreateRet(builder->CreateLoad(doubleType, result, "memo"));
+
+    builder->SetInsertPoint(miss);
+    Value *computed = builder->CreateCall(body, values, "calltmp");
+    FunctionType *storeType = FunctionType::get(Type::getVoidTy(*context), {int64Type, pointerType, doubleType},
+                                                false);
+    builder->CreateCall(storeType,
+                        address(PointerType::getUnqual(storeType), reinterpret_cast<void *>(&MemoTable::Store)),
+                        {tableAddress, argsPointer, computed});
+    builder->CreateRet(computed);
+
+    verifyFunction(*func);
+    return func;
+}
+
+};
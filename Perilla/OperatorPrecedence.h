@@ -1,34 +1,40 @@
 #pragma once
 
-#include <unordered_map>
+#include <array>
 
 using namespace std;
 
 namespace Perilla {
+    // A table indexed by the operator character, -1 for the characters that
+    // are not binary operators. All the operators are left associative.
     class BinaryOperatorPrecedence {
     public:
-        static int Get(char op) 
+        static int Get(char op)
         {
-            if (lut.find(op) != lut.end()) {
-                return lut.at(op);
-            } else {
-                return -1;
-            }
+            return lut[static_cast<unsigned char>(op)];
         }
-        
+
         static bool Support(char op)
         {
-            return lut.find(op) != lut.end();
+            return Get(op) >= 0;
         }
 
     private:
-        static const unordered_map<char, int> lut;
+        static constexpr array<int, 256> MakeTable()
+        {
+            array<int, 256> table{};
+            for (auto &precedence: table) {
+                precedence = -1;
+            }
+            table['<'] = 100;
+            table['+'] = 200;
+            table['-'] = 200;
+            table['*'] = 400;
+            return table;
+        }
+
+        static const array<int, 256> lut;
     };
     
-    const unordered_map<char, int> BinaryOperatorPrecedence::lut = {
-        {'<', 100},
-        {'+', 200},
-        {'-', 200},
-        {'*', 400}
-    };
+    const array<int, 256> BinaryOperatorPrecedence::lut = BinaryOperatorPrecedence::MakeTable();
 }
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <iostream>
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+enum class OptLevel {
+    O0,
+    O1,
+    O2,
+    O3
+};
+
+// Runs the optimization passes on the generated IR.
+// O0: nothing
+// O1: a cheap pipeline (instcombine, reassociate, gvn, simplifycfg) on every
+//     function as soon as it's generated, good for interactive use
+// O2/O3: additionally the full default module pipeline of LLVM before the
+//     module is handed over to the JIT. The JIT gets a module per
+//     definition, so inlining and the other interprocedural passes only see
+//     one definition there. Only the single module of the AOT path is
+//     optimized as a whole program.
+class Optimizer
+{
+public:
+    Optimizer(OptLevel level = OptLevel::O1): level(level), initialized(false),
+        passTime(0), functionCount(0), moduleCount(0) {}
+
+    void SetLevel(OptLevel optLevel)
+    {
+        level = optLevel;
+        initialized = false;
+    }
+
+    OptLevel GetLevel() const
+    {
+        return level;
+    }
+
+    void RunOnFunction(Function &func)
+    {
+        if (level == OptLevel::O0) {
+            return;
+        }
+
+        Initialize();
+        auto start = chrono::steady_clock::now();
+        functionPasses.run(func, functionAnalyses);
+        ClearAnalyses();
+        passTime += chrono::steady_clock::now() - start;
+        functionCount++;
+    }
+
+    // Only sees what 'module' defines, calls to other modules stay calls.
+    void RunOnModule(Module &module)
+    {
+        if (level != OptLevel::O2 && level != OptLevel::O3) {
+            return;
+        }
+
+        Initialize();
+        auto start = chrono::steady_clock::now();
+        modulePasses.run(module, moduleAnalyses);
+        ClearAnalyses();
+        passTime += chrono::steady_clock::now() - start;
+        moduleCount++;
+    }
+
+    // total time spent in optimization passes, in seconds
+    double GetPassTime() const
+    {
+        return chrono::duration<double>(passTime).count();
+    }
+
+    size_t GetFunctionCount() const
+    {
+        return functionCount;
+    }
+
+    size_t GetModuleCount() const
+    {
+        return moduleCount;
+    }
+
+    // Adds up the work of another optimizer, e.g. of a worker thread.
+    void Merge(const Optimizer &other)
+    {
+        passTime += other.passTime;
+        functionCount += other.functionCount;
+        moduleCount += other.moduleCount;
+    }
+
+    string GetString() const
+    {
+        static const char *names[] = {"O0", "O1", "O2", "O3"};
+        return string("Optimization ") + names[static_cast<int>(level)] + ": " +
+            to_string(GetPassTime() * 1000) + " ms, " +
+            to_string(functionCount) + " functions, " +
+            to_string(moduleCount) + " modules";
+    }
+
+private:
+    void Initialize()
+    {
+        if (initialized) {
+            return;
+        }
+
+        // the target machine gives the passes the cost model of the host
+        if (!targetMachine) {
+            auto builder = orc::JITTargetMachineBuilder::detectHost();
+            if (builder) {
+                auto tm = builder->createTargetMachine();
+                if (tm) {
+                    targetMachine = move(*tm);
+                } else {
+                    consumeError(tm.takeError());
+                }
+            } else {
+                consumeError(builder.takeError());
+            }
+        }
+
+        loopAnalyses = LoopAnalysisManager();
+        functionAnalyses = FunctionAnalysisManager();
+        cgsccAnalyses = CGSCCAnalysisManager();
+        moduleAnalyses = ModuleAnalysisManager();
+        passBuilder.reset(new PassBuilder(targetMachine.get()));
+        passBuilder->registerModuleAnalyses(moduleAnalyses);
+        passBuilder->registerCGSCCAnalyses(cgsccAnalyses);
+        passBuilder->registerFunctionAnalyses(functionAnalyses);
+        passBuilder->registerLoopAnalyses(loopAnalyses);
+        passBuilder->crossRegisterProxies(loopAnalyses, functionAnalyses, cgsccAnalyses, moduleAnalyses);
+
+        functionPasses = FunctionPassManager();
+        functionPasses.addPass(InstCombinePass());
+        functionPasses.addPass(ReassociatePass());
+        functionPasses.addPass(GVNPass());
+        functionPasses.addPass(SimplifyCFGPass());
+
+        modulePasses = ModulePassManager();
+        if (level == OptLevel::O2) {
+            modulePasses = passBuilder->buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+        } else if (level == OptLevel::O3) {
+            modulePasses = passBuilder->buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+        }
+
+        initialized = true;
+    }
+
+    // Every module is handed over to the JIT after optimization, cached
+    // results must not outlive the IR they were computed on.
+    void ClearAnalyses()
+    {
+        loopAnalyses.clear();
+        functionAnalyses.clear();
+        cgsccAnalyses.clear();
+        moduleAnalyses.clear();
+    }
+
+    OptLevel level;
+    bool initialized;
+    unique_ptr<TargetMachine> targetMachine;
+    unique_ptr<PassBuilder> passBuilder;
+    LoopAnalysisManager loopAnalyses;
+    FunctionAnalysisManager functionAnalyses;
+    CGSCCAnalysisManager cgsccAnalyses;
+    ModuleAnalysisManager moduleAnalyses;
+    FunctionPassManager functionPasses;
+    ModulePassManager modulePasses;
+
+    chrono::steady_clock::duration passTime;
+    size_t functionCount;
+    size_t moduleCount;
+};
+
+};
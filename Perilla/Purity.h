@@ -0,0 +1,116 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <map>
+#include "AST.h"
+
+using namespace std;
+
+namespace Perilla {
+
+// Finds the definitions that are pure: their result only depends on their
+// arguments and calling them has no side effects. Arithmetic is pure, so a
+// definition is pure unless it calls, directly or through other
+// definitions, an extern of unknown behaviour or a function that is not
+// defined at all. The math externs bound to an intrinsic (see Externs.h)
+// are pure. Recursion is fine, the analysis starts from all definitions being
+// pure and removes the ones calling anything impure until nothing changes.
+class PurityAnalysis
+{
+public:
+    void Run(const vector<ASTNode *> &roots)
+    {
+        pure.clear();
+        map<string_view, vector<string_view>> callees;
+        map<string_view, size_t> externs;  // the argument counts
+        for (auto *root: roots) {
+            if (root && root->kind == ASTNode::PrototypeKind) {
+                auto *proto = static_cast<PrototypeAST *>(root);
+                externs[proto->name] = proto->args.size();
+            } else if (root && root->kind == ASTNode::FunctionKind) {
+                auto *func = static_cast<FunctionAST *>(root);
+                if (!func->prototype->IsAnonymous()) {
+                    pure.insert(string(func->prototype->name));
+                    CollectCallees(func->body, callees[func->prototype->name]);
+                }
+            }
+        }
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto &entry: callees) {
+                auto iter = pure.find(entry.first);
+                if (iter == pure.end()) {
+                    continue;
+                }
+                for (auto callee: entry.second) {
+                    auto externIter = externs.find(callee);
+                    bool pureCallee = pure.count(callee) || (externIter != externs.end() &&
+                        IsPureExtern(callee, externIter->second) && !callees.count(callee));
+                    if (!pureCallee) {
+                        pure.erase(iter);
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    bool IsPure(string_view name) const
+    {
+        return pure.count(name) != 0;
+    }
+
+    size_t GetPureCount() const
+    {
+        return pure.size();
+    }
+
+    // Only an extern that ExternRegistry binds to the intrinsic, the one
+    // with the argument count of the intrinsic.
+    static bool IsPureExtern(string_view name, size_t argCount)
+    {
+        const IntrinsicExtern *intrinsic = ExternRegistry::LookupIntrinsic(name);
+        return intrinsic && intrinsic->argCount == argCount;
+    }
+
+private:
+    static void CollectCallees(ExprAST *root, vector<string_view> &names)
+    {
+        vector<ExprAST *> stack{root};
+        set<ExprAST *> visited;  // shared nodes once
+        while (!stack.empty()) {
+            ExprAST *node = stack.back();
+            stack.pop_back();
+            if (!node || (node->shared && !visited.insert(node).second)) {
+                continue;
+            }
+            if (node->kind == ASTNode::BinaryKind) {
+                auto *binary = static_cast<BinaryExprAST *>(node);
+                stack.push_back(binary->left);
+                stack.push_back(binary->right);
+            } else if (node->kind == ASTNode::CallKind) {
+                auto *call = static_cast<CallExprAST *>(node);
+                names.push_back(call->callee);
+                for (auto *arg: call->args) {
+                    stack.push_back(arg);
+                }
+            } else if (node->kind == ASTNode::IfKind) {
+                auto *ifExpr = static_cast<IfExprAST *>(node);
+                stack.insert(stack.end(), {ifExpr->cond, ifExpr->thenExpr, ifExpr->elseExpr});
+            } else if (node->kind == ASTNode::ForKind) {
+                auto *forExpr = static_cast<ForExprAST *>(node);
+                stack.insert(stack.end(), {forExpr->start, forExpr->end, forExpr->step, forExpr->body});
+            }
+        }
+    }
+
+    set<string, less<>> pure;
+};
+
+};
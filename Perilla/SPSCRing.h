@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstring>
+#include <cstddef>
+#include <type_traits>
+
+using namespace std;
+
+namespace Perilla {
+
+// A bounded lock-free queue between exactly one producer thread and one
+// consumer thread. The indices written by each side live on their own cache
+// line, and each side keeps a cached copy of the other side's index so that
+// the shared lines are only touched when the ring looks full or empty.
+template<typename T>
+class SPSCRing
+{
+    static_assert(std::is_trivially_copyable<T>::value, "elements are copied as bytes");
+
+public:
+    static constexpr size_t CacheLine = 64;
+
+    // the capacity is rounded up to a power of 2
+    explicit SPSCRing(size_t capacity = 4096)
+    : head(0), cachedTail(0), tail(0), cachedHead(0)
+    {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        mask = size - 1;
+        slots.reset(new Slot[size]);
+    }
+
+    SPSCRing(const SPSCRing&) = delete;
+    SPSCRing& operator=(const SPSCRing&) = delete;
+
+    // producer side
+    bool TryPush(const T &value)
+    {
+        size_t position = tail.load(memory_order_relaxed);
+        if (position - cachedHead > mask) {
+            cachedHead = head.load(memory_order_acquire);
+            if (position - cachedHead > mask) {
+                return false;  // full
+            }
+        }
+        memcpy(slots[position & mask].bytes, &value, sizeof(T));
+        tail.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    void Push(const T &value)
+    {
+        while (!TryPush(value)) {
+            std::this_thread::yield();
+        }
+    }
+
+    // consumer side
+    bool TryPop(T &value)
+    {
+        size_t position = head.load(memory_order_relaxed);
+        if (position == cachedTail) {
+            cachedTail = tail.load(memory_order_acquire);
+            if (position == cachedTail) {
+                return false;  // empty
+            }
+        }
+        memcpy(&value, slots[position & mask].bytes, sizeof(T));
+        head.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    void Pop(T &value)
+    {
+        while (!TryPop(value)) {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    struct Slot
+    {
+        alignas(T) unsigned char bytes[sizeof(T)];
+    };
+
+    // written by the consumer
+    alignas(CacheLine) atomic<size_t> head;
+    size_t cachedTail;
+    // written by the producer
+    alignas(CacheLine) atomic<size_t> tail;
+    size_t cachedHead;
+    // read only after construction
+    alignas(CacheLine) unique_ptr<Slot[]> slots;
+    size_t mask;
+};
+
+};
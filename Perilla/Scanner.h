@@ -0,0 +1,282 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define PERILLA_SCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace Perilla {
+
+// Vectorized scanning of the character runs the lexer skips over: whitespace,
+// the rest of a comment line, identifiers and digits. The implementation is
+// chosen once at runtime: AVX2 or SSE2 on x86-64, plain loops elsewhere.
+// Whitespace and alphanumerics are those of the "C" locale.
+class Scanner
+{
+public:
+    // Returns the first non-whitespace character in [p, end), or end.
+    // 'lines' is increased by the number of '\n' skipped, 'lastBreak' is
+    // set to the last of them.
+    static inline const char *SkipSpaces(const char *p, const char *end, size_t &lines, const char *&lastBreak)
+    {
+        return Get().skipSpaces(p, end, lines, lastBreak);
+    }
+
+    // Returns the first character in [p, end) which is not [0-9A-Za-z], or end.
+    static inline const char *SkipAlnum(const char *p, const char *end)
+    {
+        return Get().skipAlnum(p, end);
+    }
+
+    // Returns the first character in [p, end) which is not [0-9], or end.
+    static inline const char *SkipDigits(const char *p, const char *end)
+    {
+        return Get().skipDigits(p, end);
+    }
+
+    // Returns the first '\n' in [p, end), or end.
+    static inline const char *FindLineEnd(const char *p, const char *end)
+    {
+        return Get().findLineEnd(p, end);
+    }
+
+    static const char *GetImplementation()
+    {
+        return Get().name;
+    }
+
+private:
+    struct Functions
+    {
+        const char *name;
+        const char *(*skipSpaces)(const char *, const char *, size_t &, const char *&);
+        const char *(*skipAlnum)(const char *, const char *);
+        const char *(*skipDigits)(const char *, const char *);
+        const char *(*findLineEnd)(const char *, const char *);
+    };
+
+    static const Functions &Get()
+    {
+        static const Functions functions = Select();
+        return functions;
+    }
+
+    static Functions Select()
+    {
+#if PERILLA_SCANNER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return {"avx2", SkipSpacesAVX2, SkipAlnumAVX2, SkipDigitsAVX2, FindLineEndAVX2};
+        }
+        return {"sse2", SkipSpacesSSE2, SkipAlnumSSE2, SkipDigitsSSE2, FindLineEndSSE2};
+#else
+        return {"scalar", SkipSpacesScalar, SkipAlnumScalar, SkipDigitsScalar, FindLineEndScalar};
+#endif
+    }
+
+    static inline bool IsSpace(char ch)
+    {
+        return ch == ' ' || static_cast<unsigned char>(ch - '\t') <= '\r' - '\t';
+    }
+
+    static inline bool IsDigit(char ch)
+    {
+        return static_cast<unsigned char>(ch - '0') <= 9;
+    }
+
+    static inline bool IsAlnum(char ch)
+    {
+        return IsDigit(ch) || static_cast<unsigned char>((ch | 0x20) - 'a') <= 'z' - 'a';
+    }
+
+    static const char *SkipSpacesScalar(const char *p, const char *end, size_t &lines, const char *&lastBreak)
+    {
+        for (; p < end && IsSpace(*p); ++p) {
+            if (*p == '\n') {
+                lines++;
+                lastBreak = p;
+            }
+        }
+        return p;
+    }
+
+    static const char *SkipAlnumScalar(const char *p, const char *end)
+    {
+        while (p < end && IsAlnum(*p)) {
+            ++p;
+        }
+        return p;
+    }
+
+    static const char *SkipDigitsScalar(const char *p, const char *end)
+    {
+        while (p < end && IsDigit(*p)) {
+            ++p;
+        }
+        return p;
+    }
+
+    static const char *FindLineEndScalar(const char *p, const char *end)
+    {
+        auto eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        return eol ? eol : end;
+    }
+
+#if PERILLA_SCANNER_X86
+    // Accounts the line breaks among the first 'count' characters of a block.
+    static inline void CountBreaks(const char *block, uint32_t breaks, unsigned count,
+                                   size_t &lines, const char *&lastBreak)
+    {
+        if (count < 32) {
+            breaks &= (1u << count) - 1;
+        }
+        if (breaks) {
+            lines += __builtin_popcount(breaks);
+            lastBreak = block + (31 - __builtin_clz(breaks));
+        }
+    }
+
+    // (unsigned)(v - low) <= high - low, per byte
+    static inline __m128i InRangeSSE2(__m128i v, char low, char high)
+    {
+        __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(low));
+        return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(high - low)), offset);
+    }
+
+    static inline __m128i SpacesSSE2(__m128i v)
+    {
+        return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), InRangeSSE2(v, '\t', '\r'));
+    }
+
+    static inline __m128i AlnumSSE2(__m128i v)
+    {
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        return _mm_or_si128(InRangeSSE2(v, '0', '9'), InRangeSSE2(lower, 'a', 'z'));
+    }
+
+    static const char *SkipSpacesSSE2(const char *p, const char *end, size_t &lines, const char *&lastBreak)
+    {
+        for (; end - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            uint32_t others = ~_mm_movemask_epi8(SpacesSSE2(v)) & 0xFFFF;
+            uint32_t breaks = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+            unsigned count = others ? __builtin_ctz(others) : 16;
+            CountBreaks(p, breaks, count, lines, lastBreak);
+            if (others) {
+                return p + count;
+            }
+        }
+        return SkipSpacesScalar(p, end, lines, lastBreak);
+    }
+
+    static const char *SkipAlnumSSE2(const char *p, const char *end)
+    {
+        for (; end - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            uint32_t others = ~_mm_movemask_epi8(AlnumSSE2(v)) & 0xFFFF;
+            if (others) {
+                return p + __builtin_ctz(others);
+            }
+        }
+        return SkipAlnumScalar(p, end);
+    }
+
+    static const char *SkipDigitsSSE2(const char *p, const char *end)
+    {
+        for (; end - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            uint32_t others = ~_mm_movemask_epi8(InRangeSSE2(v, '0', '9')) & 0xFFFF;
+            if (others) {
+                return p + __builtin_ctz(others);
+            }
+        }
+        return SkipDigitsScalar(p, end);
+    }
+
+    static const char *FindLineEndSSE2(const char *p, const char *end)
+    {
+        for (; end - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            uint32_t breaks = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+            if (breaks) {
+                return p + __builtin_ctz(breaks);
+            }
+        }
+        return FindLineEndScalar(p, end);
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256i InRangeAVX2(__m256i v, char low, char high)
+    {
+        __m256i offset = _mm256_sub_epi8(v, _mm256_set1_epi8(low));
+        return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(high - low)), offset);
+    }
+
+    __attribute__((target("avx2")))
+    static const char *SkipSpacesAVX2(const char *p, const char *end, size_t &lines, const char *&lastBreak)
+    {
+        for (; end - p >= 32; p += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            __m256i spaces = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                             InRangeAVX2(v, '\t', '\r'));
+            uint32_t others = ~static_cast<uint32_t>(_mm256_movemask_epi8(spaces));
+            uint32_t breaks = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+            unsigned count = others ? __builtin_ctz(others) : 32;
+            CountBreaks(p, breaks, count, lines, lastBreak);
+            if (others) {
+                return p + count;
+            }
+        }
+        return SkipSpacesSSE2(p, end, lines, lastBreak);
+    }
+
+    __attribute__((target("avx2")))
+    static const char *SkipAlnumAVX2(const char *p, const char *end)
+    {
+        for (; end - p >= 32; p += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+            __m256i alnum = _mm256_or_si256(InRangeAVX2(v, '0', '9'), InRangeAVX2(lower, 'a', 'z'));
+            uint32_t others = ~static_cast<uint32_t>(_mm256_movemask_epi8(alnum));
+            if (others) {
+                return p + __builtin_ctz(others);
+            }
+        }
+        return SkipAlnumSSE2(p, end);
+    }
+
+    __attribute__((target("avx2")))
+    static const char *SkipDigitsAVX2(const char *p, const char *end)
+    {
+        for (; end - p >= 32; p += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            uint32_t others = ~static_cast<uint32_t>(_mm256_movemask_epi8(InRangeAVX2(v, '0', '9')));
+            if (others) {
+                return p + __builtin_ctz(others);
+            }
+        }
+        return SkipDigitsSSE2(p, end);
+    }
+
+    __attribute__((target("avx2")))
+    static const char *FindLineEndAVX2(const char *p, const char *end)
+    {
+        for (; end - p >= 32; p += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            uint32_t breaks = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+            if (breaks) {
+                return p + __builtin_ctz(breaks);
+            }
+        }
+        return FindLineEndSSE2(p, end);
+    }
+#endif
+};
+
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+#include "AST.h"
+#include "Arena.h"
+
+using namespace std;
+
+namespace Perilla {
+
+// Folds constant subtrees of the AST and applies the identities that hold
+// for every IEEE double, so that the code generator sees less. Folding
+// computes in double exactly like the emitted instructions would:
+// fadd/fsub/fmul with round to nearest, and '<' as an unordered compare,
+// so a NaN operand gives 1. Identities like x + 0 or x * 0 are not exact
+// (-0 and NaN), only these are applied:
+//   x * 1, 1 * x, x - 0, x + -0, -0 + x  ->  x
+class Simplifier
+{
+public:
+    Simplifier(): removedNodes(0), foldedNodes(0) {}
+
+    // Simplifies the bodies of the toplevel definitions in place, the new
+    // nodes are allocated in 'arena'.
+    void Run(const vector<ASTNode *> &roots, Arena &arena)
+    {
+        visited.clear();
+        replacements.clear();
+        for (auto *root: roots) {
+            if (root && root->kind == ASTNode::FunctionKind) {
+                auto *func = static_cast<FunctionAST *>(root);
+                func->body = Simplify(func->body, arena);
+            }
+        }
+    }
+
+    ExprAST *Simplify(ExprAST *root, Arena &arena)
+    {
+        // every slot holding an expression, parents before their children,
+        // rewritten in reverse so the children are done first. A shared node
+        // is only visited once, its other slots get the same result at the end.
+        slots.clear();
+        repeats.clear();
+        AddSlot(&root);
+        for (size_t idx = 0; idx < slots.size(); ++idx) {
+            ExprAST *node = *slots[idx];
+            if (!node) {
+                continue;
+            }
+            if (node->kind == ASTNode::BinaryKind) {
+                auto *binary = static_cast<BinaryExprAST *>(node);
+                AddSlot(&binary->left);
+                AddSlot(&binary->right);
+            } else if (node->kind == ASTNode::CallKind) {
+                for (auto &arg: static_cast<CallExprAST *>(node)->args) {
+                    AddSlot(&arg);
+                }
+            } else if (node->kind == ASTNode::IfKind) {
+                auto *ifExpr = static_cast<IfExprAST *>(node);
+                AddSlot(&ifExpr->cond);
+                AddSlot(&ifExpr->thenExpr);
+                AddSlot(&ifExpr->elseExpr);
+            } else if (node->kind == ASTNode::ForKind) {
+                auto *forExpr = static_cast<ForExprAST *>(node);
+                AddSlot(&forExpr->start);
+                AddSlot(&forExpr->end);
+                AddSlot(&forExpr->step);
+                AddSlot(&forExpr->body);
+            }
+        }
+        for (size_t idx = slots.size(); idx > 0; --idx) {
+            ExprAST *&slot = *slots[idx - 1];
+            if (slot && slot->kind == ASTNode::BinaryKind) {
+                ExprAST *original = slot;
+                slot = SimplifyBinary(static_cast<BinaryExprAST *>(slot), arena);
+                if (original->shared && slot != original) {
+                    if (slot->kind == ASTNode::BinaryKind) {
+                        slot->shared = true;
+                    }
+                    replacements[original] = slot;
+                }
+            }
+        }
+        for (auto *slot: repeats) {
+            auto iter = replacements.find(*slot);
+            if (iter != replacements.end()) {
+                *slot = iter->second;
+            }
+        }
+        return root;
+    }
+
+    // nodes taken out of the trees, a fold or an identity removes 2
+    size_t GetRemovedNodes() const
+    {
+        return removedNodes;
+    }
+
+    string GetString() const
+    {
+        return "Simplification: " + to_string(foldedNodes) + " folded, " +
+            to_string(removedNodes) + " nodes removed";
+    }
+
+private:
+    void AddSlot(ExprAST **slot)
+    {
+        ExprAST *node = *slot;
+        if (node && node->shared && !visited.insert(node).second) {
+            repeats.push_back(slot);
+            return;
+        }
+        slots.push_back(slot);
+    }
+
+    ExprAST *SimplifyBinary(BinaryExprAST *binary, Arena &arena)
+    {
+        ExprAST *left = binary->left;
+        ExprAST *right = binary->right;
+        if (!left || !right) {
+            return binary;
+        }
+
+        bool leftNumber = left->kind == ASTNode::NumberKind;
+        bool rightNumber = right->kind == ASTNode::NumberKind;
+        double lhs = leftNumber ? static_cast<NumberExprAST *>(left)->value : 0;
+        double rhs = rightNumber ? static_cast<NumberExprAST *>(right)->value : 0;
+
+        if (leftNumber && rightNumber) {
+            double value;
+            switch (binary->op) {
+                case '+':
+                    value = lhs + rhs;
+                    break;
+                case '-':
+                    value = lhs - rhs;
+                    break;
+                case '*':
+                    value = lhs * rhs;
+                    break;
+                case '<':
+                    // fcmp ult
+                    value = (isnan(lhs) || isnan(rhs) || lhs < rhs) ? 1.0 : 0.0;
+                    break;
+                default:
+                    // left for the code generator to report
+                    return binary;
+            }
+            removedNodes += 2;
+            foldedNodes++;
+            return arena.New<NumberExprAST>(value);
+        }
+
+        ExprAST *kept = nullptr;
+        switch (binary->op) {
+            case '*':
+                if (rightNumber && rhs == 1.0) {
+                    kept = left;
+                } else if (leftNumber && lhs == 1.0) {
+                    kept = right;
+                }
+                break;
+            case '+':
+                if (rightNumber && IsNegativeZero(rhs)) {
+                    kept = left;
+                } else if (leftNumber && IsNegativeZero(lhs)) {
+                    kept = right;
+                }
+                break;
+            case '-':
+                if (rightNumber && rhs == 0.0 && !signbit(rhs)) {
+                    kept = left;
+                }
+                break;
+            default:
+                break;
+        }
+        if (kept) {
+            removedNodes += 2;
+            return kept;
+        }
+        return binary;
+    }
+
+    static bool IsNegativeZero(double value)
+    {
+        return value == 0.0 && signbit(value);
+    }
+
+    vector<ExprAST **> slots;
+    vector<ExprAST **> repeats;  // slots of shared nodes visited before
+    unordered_set<const ExprAST *> visited;
+    unordered_map<const ExprAST *, ExprAST *> replacements;  // of the shared nodes
+    size_t removedNodes;
+    size_t foldedNodes;
+};
+
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <chrono>
+#include <cstdio>
+#include <sys/resource.h>
+#include "AST.h"
+
+using namespace std;
+
+namespace Perilla {
+
+// Wall time and counters of the phases of a compilation, reported as text
+// or as JSON. Lexing is interleaved with parsing, so the parse time doesn't
+// include the time spent in the lexer.
+class Stats
+{
+public:
+    enum Phase {
+        Lex,
+        Parse,
+        Simplify,
+        CodeGen,
+        Optimize,
+        JIT,
+        PhaseCount
+    };
+
+    enum Counter {
+        Tokens,
+        Bytes,
+        Functions,      // definitions and toplevel expressions compiled
+        IRInstructions, // as emitted, before optimization
+        ArenaBytes,     // allocated by the arenas of the AST and the identifiers
+        PeakRSS,        // peak resident memory of the process
+        NodesRemoved,   // by the simplifier
+        NodesShared,    // not allocated by the hash consing
+        TierUps,        // definitions recompiled at O3 by the tiered JIT
+        Tier0Calls,     // calls counted by tier 0 code
+        MemoHits,       // calls of memoized definitions answered by their table
+        MemoMisses,     // and the ones that ran the body
+        Clones,         // integer clones emitted by the type inference
+        CounterCount
+    };
+
+    // Adds the wall time of its scope to a phase, does nothing without stats.
+    class Timer
+    {
+    public:
+        Timer(Stats *stats, Phase phase): stats(stats), phase(phase)
+        {
+            if (stats) {
+                start = chrono::steady_clock::now();
+            }
+        }
+
+        ~Timer()
+        {
+            if (stats) {
+                stats->times[phase] += chrono::steady_clock::now() - start;
+            }
+        }
+
+    private:
+        Stats *stats;
+        Phase phase;
+        chrono::steady_clock::time_point start;
+    };
+
+    Stats(): times(), counters(), nodes() {}
+
+    void Add(Counter counter, size_t count)
+    {
+        counters[counter] += count;
+    }
+
+    // For the peak values.
+    void Max(Counter counter, size_t count)
+    {
+        counters[counter] = max(counters[counter], count);
+    }
+
+    void AddTime(Phase phase, double seconds)
+    {
+        times[phase] += chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+    }
+
+    // Counts the nodes of a tree by kind, a shared node once.
+    void CountNodes(const ASTNode *root)
+    {
+        vector<const ASTNode *> stack{root};
+        while (!stack.empty()) {
+            const ASTNode *node = stack.back();
+            stack.pop_back();
+            if (!node) {
+                continue;
+            }
+            if (node->kind == ASTNode::BinaryKind && static_cast<const ExprAST *>(node)->shared &&
+                !countedShared.insert(node).second) {
+                continue;
+            }
+            nodes[node->kind]++;
+            switch (node->kind) {
+                case ASTNode::BinaryKind: {
+                    auto *binary = static_cast<const BinaryExprAST *>(node);
+                    stack.push_back(binary->left);
+                    stack.push_back(binary->right);
+                    break;
+                }
+                case ASTNode::CallKind:
+                    for (auto *arg: static_cast<const CallExprAST *>(node)->args) {
+                        stack.push_back(arg);
+                    }
+                    break;
+                case ASTNode::IfKind: {
+                    auto *ifExpr = static_cast<const IfExprAST *>(node);
+                    stack.push_back(ifExpr->cond);
+                    stack.push_back(ifExpr->thenExpr);
+                    stack.push_back(ifExpr->elseExpr);
+                    break;
+                }
+                case ASTNode::ForKind: {
+                    auto *forExpr = static_cast<const ForExprAST *>(node);
+                    stack.push_back(forExpr->start);
+                    stack.push_back(forExpr->end);
+                    stack.push_back(forExpr->step);
+                    stack.push_back(forExpr->body);
+                    break;
+                }
+                case ASTNode::FunctionKind: {
+                    auto *func = static_cast<const FunctionAST *>(node);
+                    stack.push_back(func->prototype);
+                    stack.push_back(func->body);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Samples the peak resident memory of the process.
+    void UpdatePeakMemory()
+    {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+            Max(PeakRSS, usage.ru_maxrss);          // bytes
+#else
+            Max(PeakRSS, usage.ru_maxrss * 1024);   // kilobytes
+#endif
+        }
+    }
+
+    double GetTime(Phase phase) const
+    {
+        return chrono::duration<double>(times[phase]).count();
+    }
+
+    size_t Get(Counter counter) const
+    {
+        return counters[counter];
+    }
+
+    size_t GetNodes(ASTNode::Kind kind) const
+    {
+        return nodes[kind];
+    }
+
+    string GetString() const
+    {
+        string buffer;
+        char line[128];
+        double total = 0;
+        for (int phase = 0; phase < PhaseCount; ++phase) {
+            total += GetTime(static_cast<Phase>(phase));
+            snprintf(line, sizeof(line), "%-10s %12.3f ms\n", PhaseNames[phase], GetTime(static_cast<Phase>(phase)) * 1e3);
+            buffer += line;
+        }
+        snprintf(line, sizeof(line), "%-10s %12.3f ms\n", "total", total * 1e3);
+        buffer += line;
+        for (int counter = 0; counter < CounterCount; ++counter) {
+            snprintf(line, sizeof(line), "%-16s %12zu\n", CounterNames[counter], counters[counter]);
+            buffer += line;
+        }
+        for (int kind = 0; kind < KindCount; ++kind) {
+            snprintf(line, sizeof(line), "%-16s %12zu\n", (string("nodes.") + KindNames[kind]).c_str(), nodes[kind]);
+            buffer += line;
+        }
+        return buffer;
+    }
+
+    // Adds an object to the JSON report under 'name', for the parts that keep
+    // statistics of their own, like the object cache.
+    void AddSection(const string &name, string json)
+    {
+        sections.emplace_back(name, move(json));
+    }
+
+    // {"phases_ms": {...}, "counters": {...}, "nodes": {...}, sections...}
+    string GetJSON() const
+    {
+        string buffer = "{\"phases_ms\": {";
+        char value[64];
+        for (int phase = 0; phase < PhaseCount; ++phase) {
+            snprintf(value, sizeof(value), "%.6f", GetTime(static_cast<Phase>(phase)) * 1e3);
+            buffer += string(phase ? ", " : "") + "\"" + PhaseNames[phase] + "\": " + value;
+        }
+        buffer += "}, \"counters\": {";
+        for (int counter = 0; counter < CounterCount; ++counter) {
+            buffer += string(counter ? ", " : "") + "\"" + CounterNames[counter] + "\": " + to_string(counters[counter]);
+        }
+        buffer += "}, \"nodes\": {";
+        for (int kind = 0; kind < KindCount; ++kind) {
+            buffer += string(kind ? ", " : "") + "\"" + KindNames[kind] + "\": " + to_string(nodes[kind]);
+        }
+        buffer += "}";
+        for (auto &section: sections) {
+            buffer += ", \"" + section.first + "\": " + section.second;
+        }
+        buffer += "}";
+        return buffer;
+    }
+
+private:
+    static constexpr int KindCount = ASTNode::FunctionKind + 1;
+    static constexpr const char *PhaseNames[PhaseCount] = {"lex", "parse", "simplify", "codegen", "optimize", "jit"};
+    static constexpr const char *CounterNames[CounterCount] = {
+        "tokens", "bytes", "functions", "ir_instructions", "arena_bytes", "peak_rss_bytes", "nodes_removed", "nodes_shared", "tier_ups", "tier0_calls", "memo_hits", "memo_misses", "clones"
+    };
+    static constexpr const char *KindNames[KindCount] = {
+        "number", "variable", "binary", "call", "if", "for", "prototype", "function"
+    };
+
+    chrono::steady_clock::duration times[PhaseCount];
+    size_t counters[CounterCount];
+    size_t nodes[KindCount];
+    unordered_set<const ASTNode *> countedShared;
+    vector<pair<string, string>> sections;  // name, JSON object
+};
+
+};
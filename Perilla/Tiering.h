@@ -0,0 +1,295 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include "AST.h"
+#include "JIT.h"
+#include "Optimizer.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+// Tiered compilation of the definitions. Every definition 'foo' is emitted
+// as tier 0 'foo.t0', unoptimized and counting its calls, and a stub 'foo'
+// that calls through a slot holding the address of the current tier; all
+// the calls go to the stub. When the count reaches the threshold, tier 0
+// notifies the compiler, which compiles 'foo.t1' at O3 on a background
+// thread and stores its address into the slot. The counters and the slots
+// live in host memory and their addresses are constants in the code, so
+// the modules must not be cached.
+class TieredCompiler
+{
+public:
+    TieredCompiler(PerillaJIT &jit, uint64_t threshold, const ExternRegistry *registry = nullptr)
+    : jit(jit), threshold(max<uint64_t>(threshold, 1)), registry(registry), optimizer(OptLevel::O3), stop(false), pending(0),
+      tierUps(0), compileTime(0)
+    {
+        worker = std::thread(&TieredCompiler::Work, this);
+    }
+
+    ~TieredCompiler()
+    {
+        {
+            lock_guard<mutex> lock(queueLock);
+            stop = true;
+        }
+        queueChanged.notify_all();
+        worker.join();
+    }
+
+    // Emits the stub and tier 0 of a definition into the current module,
+    // returns the stub.
+    Function *EmitTier0(FunctionAST &def)
+    {
+        PrototypeAST *proto = def.prototype;
+        string name(proto->name);
+        vector<string> args(proto->args.begin(), proto->args.end());
+        {
+            lock_guard<mutex> lock(queueLock);
+            protos[name] = args;
+        }
+
+        Function *stub = module->getFunction(name);
+        if (!stub) {
+            stub = DeclareFunction(name, args);
+        }
+        if (!stub->empty()) {
+            return (Function*)LogErrorV("Function cannot be redefined");
+        }
+        Function *tier0 = Function::Create(stub->getFunctionType(), Function::InternalLinkage,
+                                           name + ".t0", module.get());
+        size_t idx = 0;
+        for (auto &arg: tier0->args()) {
+            arg.setName(args[idx++]);
+        }
+        if (!EmitFunction(tier0, [&def]() { return def.body->CodeGen(); })) {
+            return nullptr;
+        }
+
+        slots.emplace_back();
+        Slot &slot = slots.back();
+        slot.def = &def;
+        slot.name = name;
+        EmitCounter(tier0, slot);
+        EmitStub(stub, tier0, slot);
+        return stub;
+    }
+
+    // Waits until the recompilations asked for so far are done.
+    void Drain()
+    {
+        unique_lock<mutex> lock(queueLock);
+        queueChanged.wait(lock, [this]() { return pending == 0; });
+    }
+
+    uint64_t GetThreshold() const
+    {
+        return threshold;
+    }
+
+    size_t GetTierUps() const
+    {
+        return tierUps;
+    }
+
+    // calls counted by tier 0 code
+    uint64_t GetCalls() const
+    {
+        uint64_t calls = 0;
+        for (auto &slot: slots) {
+            calls += slot.calls.load(memory_order_relaxed);
+        }
+        return calls;
+    }
+
+    string GetString() const
+    {
+        string buffer = "Tiering: threshold " + to_string(threshold) + ", " + to_string(tierUps) + " of " +
+            to_string(slots.size()) + " functions recompiled at O3 in " + to_string(compileTime * 1000) + " ms";
+        for (auto &slot: slots) {
+            if (slot.impl.load(memory_order_acquire)) {
+                buffer += "\n  " + slot.name + ": " + to_string(slot.calls.load(memory_order_relaxed)) +
+                    " calls in tier 0";
+            }
+        }
+        return buffer;
+    }
+
+    // The same as GetString, the recompiled definitions map to their tier 0
+    // calls.
+    string GetJSON() const
+    {
+        string buffer = "{\"threshold\": " + to_string(threshold) + ", \"tier_ups\": " + to_string(tierUps) +
+            ", \"functions\": " + to_string(slots.size()) + ", \"compile_ms\": " + to_string(compileTime * 1000) +
+            ", \"recompiled\": {";
+        bool first = true;
+        for (auto &slot: slots) {
+            if (slot.impl.load(memory_order_acquire)) {
+                buffer += string(first ? "" : ", ") + "\"" + slot.name + "\": " +
+                    to_string(slot.calls.load(memory_order_relaxed));
+                first = false;
+            }
+        }
+        return buffer + "}}";
+    }
+
+private:
+    struct Slot
+    {
+        atomic<uint64_t> calls{0};
+        atomic<uint64_t> impl{0};  // the address of tier 1 once compiled
+        FunctionAST *def = nullptr;
+        string name;
+    };
+
+    // Called by tier 0 code when the count reaches the threshold, once.
+    static void Notify(TieredCompiler *self, Slot *slot)
+    {
+        {
+            lock_guard<mutex> lock(self->queueLock);
+            self->queue.push_back(slot);
+            self->pending++;
+        }
+        self->queueChanged.notify_all();
+    }
+
+    static Constant *Address(Type *type, const void *pointer)
+    {
+        Constant *value = ConstantInt::get(Type::getInt64Ty(*context), reinterpret_cast<uint64_t>(pointer));
+        return ConstantExpr::getIntToPtr(value, type);
+    }
+
+    // Puts a block counting the calls in front of the entry of tier 0.
+    void EmitCounter(Function *tier0, Slot &slot)
+    {
+        Type *int64Type = Type::getInt64Ty(*context);
+        BasicBlock *body = &tier0->getEntryBlock();
+        BasicBlock *count = BasicBlock::Create(*context, "count", tier0, body);
+        BasicBlock *notify = BasicBlock::Create(*context, "notify", tier0, body);
+
+        builder->SetInsertPoint(count);
+        Value *counter = Address(PointerType::getUnqual(int64Type), &slot.calls);
+        Value *calls = builder->CreateAtomicRMW(AtomicRMWInst::Add, counter, ConstantInt::get(int64Type, 1),
+                                                Align(8), AtomicOrdering::Monotonic);
+        Value *hot = builder->CreateICmpEQ(calls, ConstantInt::get(int64Type, threshold - 1), "hot");
+        builder->CreateCondBr(hot, notify, body);
+
+        builder->SetInsertPoint(notify);
+        FunctionType *notifyType = FunctionType::get(Type::getVoidTy(*context), {int64Type, int64Type}, false);
+        builder->CreateCall(notifyType,
+                            Address(PointerType::getUnqual(notifyType), reinterpret_cast<void *>(&Notify)),
+                            {ConstantInt::get(int64Type, reinterpret_cast<uint64_t>(this)),
+                             ConstantInt::get(int64Type, reinterpret_cast<uint64_t>(&slot))});
+        builder->CreateBr(body);
+    }
+
+    // stub(args) = (slot.impl ? slot.impl : tier0)(args)
+    void EmitStub(Function *stub, Function *tier0, Slot &slot)
+    {
+        Type *int64Type = Type::getInt64Ty(*context);
+        Type *pointerType = PointerType::getUnqual(stub->getFunctionType());
+        BasicBlock *entry = BasicBlock::Create(*context, "entry", stub);
+        builder->SetInsertPoint(entry);
+        LoadInst *impl = builder->CreateLoad(int64Type, Address(PointerType::getUnqual(int64Type), &slot.impl), "impl");
+        impl->setAtomic(AtomicOrdering::Acquire);
+        impl->setAlignment(Align(8));
+        Value *compiled = builder->CreateICmpNE(impl, ConstantInt::get(int64Type, 0), "compiled");
+        Value *target = builder->CreateSelect(compiled, builder->CreateIntToPtr(impl, pointerType), tier0, "target");
+        SmallVector<Value *, 8> args;
+        for (auto &arg: stub->args()) {
+            args.push_back(&arg);
+        }
+        CallInst *call = builder->CreateCall(stub->getFunctionType(), target, args, "calltmp");
+        call->setTailCall();
+        builder->CreateRet(call);
+        verifyFunction(*stub);
+    }
+
+    // The background thread, with code generation state of its own.
+    void Work()
+    {
+        while (true) {
+            Slot *slot;
+            {
+                unique_lock<mutex> lock(queueLock);
+                queueChanged.wait(lock, [this]() { return stop || !queue.empty(); });
+                if (stop) {
+                    break;
+                }
+                slot = queue.front();
+                queue.pop_front();
+                functionProtos = protos;
+                externRegistry = registry;
+            }
+            auto start = chrono::steady_clock::now();
+            CompileTier1(*slot);
+            compileTime += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            {
+                lock_guard<mutex> lock(queueLock);
+                pending--;
+            }
+            queueChanged.notify_all();
+        }
+        builder.reset();
+        module.reset();
+        context.reset();
+        symbolTable.clear();
+        functionProtos.clear();
+        externRegistry = nullptr;
+    }
+
+    void CompileTier1(Slot &slot)
+    {
+        InitializeModule(jit.GetDataLayout());
+        PrototypeAST *proto = slot.def->prototype;
+        vector<Type *> doubles(proto->args.size(), Type::getDoubleTy(*context));
+        FunctionType *type = FunctionType::get(Type::getDoubleTy(*context), doubles, false);
+        Function *tier1 = Function::Create(type, Function::ExternalLinkage, slot.name + ".t1", module.get());
+        size_t idx = 0;
+        for (auto &arg: tier1->args()) {
+            arg.setName(proto->args[idx++]);
+        }
+        FunctionAST *def = slot.def;
+        if (!EmitFunction(tier1, [def]() { return def->body->CodeGen(); })) {
+            return;
+        }
+        optimizer.RunOnFunction(*tier1);
+        optimizer.RunOnModule(*module);
+        if (!jit.AddModule(move(module), move(context))) {
+            return;
+        }
+        if (uint64_t address = jit.Lookup(slot.name + ".t1")) {
+            slot.impl.store(address, memory_order_release);
+            tierUps++;
+        }
+    }
+
+    PerillaJIT &jit;
+    uint64_t threshold;
+    const ExternRegistry *registry;
+    Optimizer optimizer;  // only used by the worker
+    // appended by the code generating thread only, the worker gets pointers
+    deque<Slot> slots;
+
+    mutex queueLock;
+    condition_variable queueChanged;
+    deque<Slot *> queue;
+    map<string, vector<string>, less<>> protos;  // snapshot for the worker
+    bool stop;
+    size_t pending;
+    // written by the worker, read after Drain
+    size_t tierUps;
+    double compileTime;
+    std::thread worker;
+};
+
+};
@@ -2,8 +2,12 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <cassert>
+#include <cstdint>
+#include <array>
+#include "Interner.h"
 
 using namespace std;
 
@@ -15,66 +19,42 @@ public:
     enum Type {
         Def,
         Extern,
+        If,
+        Then,
+        Else,
+        For,
+        In,
         Ident,
         Number,
         Unknown,
         Eof
     };
     
+    static const uint32_t NoId = UINT32_MAX;
+    
+    // A token does not own its content, it's a view into the source or
+    // into the identifiers interned by the lexer. Copying a token is cheap.
     Token(Type type) noexcept
-    : type(type)
+    : type(type), id(NoId), numericValue(0), character(0)
     {
         assert(type == Eof);
     }
 
-    Token(Type type, string cont) noexcept
-    : type(type), content(move(cont))
+    Token(Type type, string_view cont, uint32_t identId = NoId) noexcept
+    : type(type), content(cont), id(identId), numericValue(0), character(0)
     {
-        if (type == Number) {
-            numericValue = stod(content);
-        } else if (type == Unknown) {
-            character = content[0];
-        }
+        assert(type != Number);
     }
 
-    Token(char ch) noexcept
-    : type(Unknown), content(1, ch), character(ch) {}
-    
-    Token(const Token& token) noexcept
-    {
-        type = token.type;
-        content = token.content;
-        numericValue = token.numericValue;
-        character = token.character;
-    }
-    
-    Token(Token&& token) noexcept
-    {
-        type = token.type;
-        swap(content, token.content);
-        numericValue = token.numericValue;
-        character = token.character;
-    }
-    
-    ~Token() = default;
-    
-    Token& operator=(const Token& token) noexcept
-    {
-        type = token.type;
-        content = token.content;
-        numericValue = token.numericValue;
-        character = token.character;
-        return *this;
-    }
-    
-    Token& operator=(Token&& token) noexcept
+    Token(Type type, string_view cont, double value) noexcept
+    : type(type), content(cont), id(NoId), numericValue(value), character(0)
     {
-        type = token.type;
-        swap(content, token.content);
-        numericValue = token.numericValue;
-        character = token.character;
-        return *this;
+        assert(type == Number);
     }
+
+    Token(char ch) noexcept
+    : type(Unknown), content(&Characters()[static_cast<unsigned char>(ch)], 1),
+      id(NoId), numericValue(0), character(ch) {}
     
     inline bool IsDef() const
     {
@@ -86,6 +66,12 @@ public:
         return type == Extern;
     }
     
+    // if, then, else, for, in
+    inline bool IsControl() const
+    {
+        return type >= If && type <= In;
+    }
+    
     inline bool IsIdent() const
     {
         return type == Ident;
@@ -111,11 +97,17 @@ public:
         return type;
     }
     
-    inline string GetContent() const
+    inline string_view GetContent() const
     {
         return content;
     }
     
+    // id of the interned identifier or keyword, NoId for other tokens
+    inline uint32_t GetId() const
+    {
+        return id;
+    }
+    
     inline double GetNumeric() const
     {
         return numericValue;
@@ -132,7 +124,7 @@ public:
             return false;
         }
         
-        if (type == Def || type == Extern || type == Eof) {
+        if (type == Def || type == Extern || IsControl() || type == Eof) {
             return true;
         }
         
@@ -157,6 +149,13 @@ public:
             case Token::Extern:
                 buffer << "extern";
                 break;
+            case Token::If:
+            case Token::Then:
+            case Token::Else:
+            case Token::For:
+            case Token::In:
+                buffer << content;
+                break;
             case Token::Ident:
                 buffer << "id " << content;
                 break;
@@ -177,17 +176,41 @@ public:
     
     static const Token DefToken;
     static const Token ExternToken;
+    static const Token IfToken;
+    static const Token ThenToken;
+    static const Token ElseToken;
+    static const Token ForToken;
+    static const Token InToken;
     static const Token EofToken;
 
 private:
+    // every character once, the content of the single character tokens
+    static const char *Characters()
+    {
+        static const array<char, 256> characters = []() {
+            array<char, 256> chars;
+            for (size_t i = 0; i < chars.size(); ++i) {
+                chars[i] = static_cast<char>(i);
+            }
+            return chars;
+        }();
+        return characters.data();
+    }
+
     Type type;
-    string content;
+    string_view content;
+    uint32_t id;
     double numericValue;
     char character;
 };
     
-const Token Token::DefToken = {Token::Type::Def, "def"};
-const Token Token::ExternToken = {Token::Type::Extern, "extern"};
+const Token Token::DefToken = {Token::Type::Def, "def", Interner::DefId};
+const Token Token::ExternToken = {Token::Type::Extern, "extern", Interner::ExternId};
+const Token Token::IfToken = {Token::Type::If, "if", Interner::IfId};
+const Token Token::ThenToken = {Token::Type::Then, "then", Interner::ThenId};
+const Token Token::ElseToken = {Token::Type::Else, "else", Interner::ElseId};
+const Token Token::ForToken = {Token::Type::For, "for", Interner::ForId};
+const Token Token::InToken = {Token::Type::In, "in", Interner::InId};
 const Token Token::EofToken = {Token::Type::Eof};
 
 ostream& operator<<(ostream& out, Token& token)
@@ -199,6 +222,13 @@ ostream& operator<<(ostream& out, Token& token)
         case Token::Extern:
             out << "extern";
             break;
+        case Token::If:
+        case Token::Then:
+        case Token::Else:
+        case Token::For:
+        case Token::In:
+            out << token.content;
+            break;
         case Token::Ident:
             out << "id " << token.content;
             break;
@@ -0,0 +1,471 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include "AST.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace Perilla {
+
+// The clones of TypeInference asked for by the code generating threads.
+// Each clone is queued once, by name, and emitted by whichever thread takes
+// it, into a module of its own. It also remembers which clones were found
+// worth emitting, so that the callees are only looked at once.
+class CloneQueue
+{
+public:
+    struct Request
+    {
+        FunctionAST *def;
+        vector<bool> ints;
+        string name;
+    };
+
+    // Queues the clone unless it was asked for before.
+    void Add(FunctionAST *def, const vector<bool> &ints, const string &name)
+    {
+        lock_guard<mutex> guard(lock);
+        if (names.insert(name).second) {
+            pending.push_back({def, ints, name});
+        }
+    }
+
+    // Whether Decide was called for the clone, with its answer in
+    // 'worthwhile'.
+    bool Decided(const string &name, bool &worthwhile)
+    {
+        lock_guard<mutex> guard(lock);
+        auto iter = decisions.find(name);
+        if (iter == decisions.end()) {
+            return false;
+        }
+        worthwhile = iter->second;
+        return true;
+    }
+
+    void Decide(const string &name, bool worthwhile)
+    {
+        lock_guard<mutex> guard(lock);
+        decisions.emplace(name, worthwhile);
+    }
+
+    // Takes the next clone to emit, false when there is none.
+    bool Take(Request &request)
+    {
+        lock_guard<mutex> guard(lock);
+        if (pending.empty()) {
+            return false;
+        }
+        request = move(pending.front());
+        pending.pop_front();
+        return true;
+    }
+
+    static bool IsClone(const Function &func)
+    {
+        return !func.isIntrinsic() && func.getName().contains('.');
+    }
+
+private:
+    mutex lock;
+    set<string, less<>> names;
+    deque<Request> pending;
+    map<string, bool, less<>> decisions;
+};
+
+// Finds the subexpressions of a definition whose values are exact integers,
+// and emits them with i64 arithmetic and the comparisons as i1. A value is
+// an exact integer when its range is known and within 2^53, where a double
+// holds every integer, so the integer result converted back is what the
+// double arithmetic gives. A product that may be -0 stays a double.
+//
+// A call passing an exact integer goes to a clone of the callee, 'foo.id'
+// for 'foo(x y)' with an integer x, whose integer arguments are i64. The
+// clone assumes them within 2^26, so that the product of two of them and
+// some sums are still exact, and calls the generic 'foo' for the others.
+// A clone is only made when its integer arguments give it some integer
+// arithmetic or comparison to do, else it would just be a second copy of
+// 'foo' to compile. The callers only declare the clones they call and
+// queue them in a CloneQueue, each clone is emitted once by EmitClone and
+// returns a double. The toplevel expressions run once and don't ask for
+// clones.
+class TypeInference
+{
+public:
+    // the definitions calls may be cloned from, by name
+    using Definitions = map<string_view, FunctionAST *, less<>>;
+
+    static constexpr int64_t MaxExact = int64_t(1) << 53;
+    static constexpr int64_t ArgumentBound = int64_t(1) << 26;
+
+    TypeInference(const Definitions &definitions, CloneQueue &queue)
+    : definitions(definitions), queue(queue), cloning(false) {}
+
+    // Emits 'def' into the current module like FunctionAST::CodeGen, with
+    // the declarations of the clones it calls.
+    Function *Emit(FunctionAST &def)
+    {
+        Function *func = module->getFunction(def.prototype->name);
+        if (!func) {
+            func = def.prototype->CodeGen();
+        }
+        if (!func || !func->empty()) {
+            return EmitFunction(func, []() -> Value * { return nullptr; });
+        }
+
+        ExprTypes types;
+        cloning = !def.prototype->IsAnonymous();
+        Infer(def.body, map<string_view, Range>(), types);
+        return EmitFunction(func, [&def, &types]() -> Value * {
+            exprTypes = &types;
+            Value *value = def.body->CodeGen();
+            exprTypes = nullptr;
+            return value ? ToDouble(value) : nullptr;
+        });
+    }
+
+    // Emits the clone into the current module, with the declarations of the
+    // clones it calls. nullptr when not even the generic call compiles.
+    Function *EmitClone(const CloneQueue::Request &request)
+    {
+        Function *func = Declare(request.def, request.ints, request.name);
+        ExprTypes types;
+        map<string_view, Range> params;
+        for (size_t arg = 0; arg < request.ints.size(); ++arg) {
+            if (request.ints[arg]) {
+                params[request.def->prototype->args[arg]] = {true, -ArgumentBound, ArgumentBound};
+            }
+        }
+        cloning = true;
+        Infer(request.def->body, params, types);
+        // the errors of the body are reported again by the generic definition
+        if (!EmitCloneBody(func, *request.def, &types) && !EmitCloneBody(func, *request.def, nullptr)) {
+            if (func->use_empty()) {
+                func->eraseFromParent();
+            }
+            return nullptr;
+        }
+        return func;
+    }
+
+private:
+    // an exact integer in [lo, hi], comparisons are in [0, 1]
+    struct Range
+    {
+        bool exact;
+        int64_t lo;
+        int64_t hi;
+    };
+
+    static Range Inexact()
+    {
+        return {false, 0, 0};
+    }
+
+    static Range Bounded(int64_t lo, int64_t hi)
+    {
+        return lo >= -MaxExact && hi <= MaxExact ? Range{true, lo, hi} : Inexact();
+    }
+
+    static Range InferNumber(double value)
+    {
+        if (value != trunc(value) || fabs(value) > static_cast<double>(MaxExact) || (value == 0 && signbit(value))) {
+            return Inexact();
+        }
+        auto integer = static_cast<int64_t>(value);
+        return {true, integer, integer};
+    }
+
+    static Range InferBinary(char op, Range lhs, Range rhs)
+    {
+        if (op == '<') {
+            return {true, 0, 1};
+        }
+        if (!lhs.exact || !rhs.exact) {
+            return Inexact();
+        }
+        // both within 2^53, the sums don't overflow
+        switch (op) {
+            case '+':
+                return Bounded(lhs.lo + rhs.lo, lhs.hi + rhs.hi);
+            case '-':
+                return Bounded(lhs.lo - rhs.hi, lhs.hi - rhs.lo);
+            case '*': {
+                // 0 times a negative number is -0
+                bool zeroLhs = lhs.lo <= 0 && lhs.hi >= 0, zeroRhs = rhs.lo <= 0 && rhs.hi >= 0;
+                if ((zeroLhs && rhs.lo < 0) || (zeroRhs && lhs.lo < 0)) {
+                    return Inexact();
+                }
+                int64_t corners[4];
+                if (__builtin_mul_overflow(lhs.lo, rhs.lo, &corners[0]) ||
+                    __builtin_mul_overflow(lhs.lo, rhs.hi, &corners[1]) ||
+                    __builtin_mul_overflow(lhs.hi, rhs.lo, &corners[2]) ||
+                    __builtin_mul_overflow(lhs.hi, rhs.hi, &corners[3])) {
+                    return Inexact();
+                }
+                return Bounded(*min_element(corners, corners + 4), *max_element(corners, corners + 4));
+            }
+            default:
+                return Inexact();
+        }
+    }
+
+    // The ranges of the nodes of 'body' from the ranges of the arguments,
+    // with an explicit stack like EmitExpr, and the ranges of the operands
+    // on a stack of their own. Only the shared nodes are looked up by node.
+    // A loop variable is a double hiding the argument of the same name.
+    // Returns the number of binary nodes emitted on integers.
+    size_t Infer(ExprAST *body, map<string_view, Range> params, ExprTypes &types)
+    {
+        size_t integerOps = 0;
+        unordered_map<const ExprAST *, Range> sharedRanges;
+        vector<pair<ExprAST *, int>> stack{{body, 0}};
+        vector<Range> operands;
+        vector<pair<bool, Range>> hidden;  // the ranges the loop variables hide
+        while (!stack.empty()) {
+            auto [node, stage] = stack.back();
+            stack.pop_back();
+            if (!node) {
+                operands.push_back(Inexact());
+                continue;
+            }
+            if (stage == 0 && node->shared) {
+                auto iter = sharedRanges.find(node);
+                if (iter != sharedRanges.end()) {
+                    operands.push_back(iter->second);
+                    continue;
+                }
+            }
+            Range range = Inexact();
+            if (node->kind == ASTNode::NumberKind) {
+                range = InferNumber(static_cast<NumberExprAST *>(node)->value);
+            } else if (node->kind == ASTNode::VariableKind) {
+                auto iter = params.find(static_cast<VariableExprAST *>(node)->variable);
+                range = iter != params.end() ? iter->second : Inexact();
+            } else if (node->kind == ASTNode::BinaryKind) {
+                auto *binary = static_cast<BinaryExprAST *>(node);
+                if (stage == 0) {
+                    stack.push_back({node, 1});
+                    stack.push_back({binary->right, 0});
+                    stack.push_back({binary->left, 0});
+                    continue;
+                }
+                Range rhs = operands.back();
+                operands.pop_back();
+                Range lhs = operands.back();
+                operands.pop_back();
+                range = InferBinary(binary->op, lhs, rhs);
+                if (lhs.exact && rhs.exact && (binary->op == '<' || range.exact)) {
+                    integerOps++;
+                }
+            } else if (node->kind == ASTNode::CallKind) {
+                auto *call = static_cast<CallExprAST *>(node);
+                if (stage == 0) {
+                    stack.push_back({node, 1});
+                    for (size_t idx = call->args.size(); idx > 0; --idx) {
+                        stack.push_back({call->args[idx - 1], 0});
+                    }
+                    continue;
+                }
+                vector<bool> ints;
+                bool any = false;
+                for (size_t idx = operands.size() - call->args.size(); idx < operands.size(); ++idx) {
+                    ints.push_back(operands[idx].exact);
+                    any = any || ints.back();
+                }
+                operands.resize(operands.size() - call->args.size());
+                if (any && cloning) {
+                    if (Function *clone = RequestClone(call->callee, ints)) {
+                        types.clones[node] = clone;
+                    }
+                }
+            } else if (node->kind == ASTNode::IfKind) {
+                auto *ifExpr = static_cast<IfExprAST *>(node);
+                if (stage == 0) {
+                    stack.push_back({node, 1});
+                    stack.insert(stack.end(), {{ifExpr->elseExpr, 0}, {ifExpr->thenExpr, 0}, {ifExpr->cond, 0}});
+                    continue;
+                }
+                // the arms meet as i64 when both are integers
+                Range elseRange = operands.back();
+                operands.pop_back();
+                Range thenRange = operands.back();
+                operands.resize(operands.size() - 2);
+                if (thenRange.exact && elseRange.exact) {
+                    range = {true, min(thenRange.lo, elseRange.lo), max(thenRange.hi, elseRange.hi)};
+                }
+            } else if (node->kind == ASTNode::ForKind) {
+                auto *forExpr = static_cast<ForExprAST *>(node);
+                if (stage == 0) {
+                    stack.push_back({node, 1});
+                    stack.push_back({forExpr->start, 0});
+                    continue;
+                } else if (stage == 1) {
+                    operands.pop_back();
+                    auto iter = params.find(forExpr->variable);
+                    hidden.emplace_back(iter != params.end(), iter != params.end() ? iter->second : Inexact());
+                    params[forExpr->variable] = Inexact();
+                    stack.push_back({node, 2});
+                    stack.insert(stack.end(), {{forExpr->body, 0}, {forExpr->step, 0}, {forExpr->end, 0}});
+                    continue;
+                }
+                // end, step and body
+                operands.resize(operands.size() - 3);
+                if (hidden.back().first) {
+                    params[forExpr->variable] = hidden.back().second;
+                } else {
+                    params.erase(forExpr->variable);
+                }
+                hidden.pop_back();
+            }
+            bool arithmetic = node->kind == ASTNode::BinaryKind && static_cast<BinaryExprAST *>(node)->op != '<';
+            if (range.exact && (node->kind == ASTNode::NumberKind || arithmetic)) {
+                types.ints.insert(node);
+            }
+            if (node->shared) {
+                sharedRanges[node] = range;
+            }
+            operands.push_back(range);
+        }
+        return integerOps;
+    }
+
+    // The clone of 'callee' for the integer arguments 'ints', declared in
+    // the current module and queued. nullptr when the callee can't be cloned
+    // or the clone isn't worth it.
+    Function *RequestClone(string_view callee, const vector<bool> &ints)
+    {
+        auto def = definitions.find(callee);
+        // a definition this thread knows of at this point, like GetFunction
+        if (def == definitions.end() || def->second->prototype->args.size() != ints.size() ||
+            !functionProtos.count(callee)) {
+            return nullptr;
+        }
+        string name = string(callee) + ".";
+        for (bool integer: ints) {
+            name += integer ? 'i' : 'd';
+        }
+        bool worthwhile;
+        if (!queue.Decided(name, worthwhile)) {
+            worthwhile = IsWorthCloning(def->second, ints);
+            queue.Decide(name, worthwhile);
+        }
+        if (!worthwhile) {
+            return nullptr;
+        }
+        queue.Add(def->second, ints, name);
+        return Declare(def->second, ints, name);
+    }
+
+    // Whether the body of the clone has any integer operation. The calls it
+    // makes aren't followed, a callee that only passes its integers on is
+    // called generically.
+    bool IsWorthCloning(FunctionAST *def, const vector<bool> &ints)
+    {
+        map<string_view, Range> params;
+        for (size_t arg = 0; arg < ints.size(); ++arg) {
+            if (ints[arg]) {
+                params[def->prototype->args[arg]] = {true, -ArgumentBound, ArgumentBound};
+            }
+        }
+        ExprTypes types;
+        bool wasCloning = cloning;
+        cloning = false;
+        size_t integerOps = Infer(def->body, params, types);
+        cloning = wasCloning;
+        return integerOps != 0;
+    }
+
+    // The clone in the current module, declared if it's not there yet.
+    static Function *Declare(FunctionAST *def, const vector<bool> &ints, const string &name)
+    {
+        if (Function *func = module->getFunction(name)) {
+            return func;
+        }
+        vector<Type *> params;
+        for (bool integer: ints) {
+            params.push_back(integer ? Type::getInt64Ty(*context) : Type::getDoubleTy(*context));
+        }
+        FunctionType *type = FunctionType::get(Type::getDoubleTy(*context), params, false);
+        Function *func = Function::Create(type, Function::ExternalLinkage, name, module.get());
+        size_t idx = 0;
+        for (auto &arg: func->args()) {
+            arg.setName(def->prototype->args[idx++]);
+        }
+        return func;
+    }
+
+    // Like EmitFunction, except that a failed clone keeps its declaration.
+    // Without 'types' the clone only calls the generic definition.
+    static bool EmitCloneBody(Function *func, FunctionAST &def, const ExprTypes *types)
+    {
+        BasicBlock *entry = BasicBlock::Create(*context, "entry", func);
+        BasicBlock *generic = BasicBlock::Create(*context, "generic", func);
+        BasicBlock *body = types ? BasicBlock::Create(*context, "body", func) : nullptr;
+        builder->SetInsertPoint(entry);
+        symbolTable.clear();
+        sharedValues.clear();
+        sharedKeys.clear();
+        Value *inRange = nullptr;
+        SmallVector<Value *, 8> doubles;
+        for (auto &arg: func->args()) {
+            symbolTable[string(arg.getName())] = &arg;
+            if (arg.getType()->isIntegerTy()) {
+                // -bound <= arg <= bound
+                Type *type = arg.getType();
+                Value *offset = builder->CreateAdd(&arg, ConstantInt::get(type, ArgumentBound));
+                Value *within = builder->CreateICmpULE(offset, ConstantInt::get(type, 2 * ArgumentBound));
+                inRange = inRange ? builder->CreateAnd(inRange, within) : within;
+            }
+        }
+        if (body) {
+            builder->CreateCondBr(inRange, body, generic);
+        } else {
+            builder->CreateBr(generic);
+        }
+
+        builder->SetInsertPoint(generic);
+        for (auto &arg: func->args()) {
+            doubles.push_back(ToDouble(&arg));
+        }
+        Function *callee = GetFunction(def.prototype->name);
+        if (!callee) {
+            func->deleteBody();
+            return false;
+        }
+        builder->CreateRet(builder->CreateCall(callee, doubles, "calltmp"));
+        if (!body) {
+            verifyFunction(*func);
+            return true;
+        }
+
+        builder->SetInsertPoint(body);
+        exprTypes = types;
+        Value *value = def.body->CodeGen();
+        exprTypes = nullptr;
+        if (!value) {
+            func->deleteBody();
+            return false;
+        }
+        builder->CreateRet(ToDouble(value));
+        verifyFunction(*func);
+        return true;
+    }
+
+    const Definitions &definitions;
+    CloneQueue &queue;
+    bool cloning;  // whether calls may go to clones
+};
+
+};
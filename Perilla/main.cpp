@@ -1,22 +1,91 @@
 #include "Lexer.h"
-#include "AST.h"
+#include "MMapLexer.h"
+#include "ASTGenerator.h"
+#include "AOT.h"
 
 using namespace Perilla;
 
-int main()
+int main(int argc, char *argv[])
 {
-//    string src = R"CODE(
-//# Compute the x'th fibonacci number.
-//def fib(x)
-//  if x < 3 then
-//    1
-//  else
-//    fib(x-1)+fib(x-2)
-//
-//# This expression will compute the 40th number.
-//fib(5)
-//)CODE";
-    
+    OptLevel level = OptLevel::O1;
+    string path;
+    bool flat = false;
+    bool pipeline = false;
+    bool simplify = true;
+    bool share = true;
+    bool inferTypes = false;
+    unsigned threads = 1;
+    unsigned parseThreads = 1;
+    bool printStats = false;
+    bool printJSON = false;
+    string aotBase;
+    string cpu;
+    string features;
+    uint64_t tierThreshold = 0;
+    size_t memoCapacity = 0;
+    string cacheDir;
+    size_t cacheBytes = DiskObjectCache::DefaultMaxBytes;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-O0") {
+            level = OptLevel::O0;
+        } else if (arg == "-O1") {
+            level = OptLevel::O1;
+        } else if (arg == "-O2") {
+            level = OptLevel::O2;
+        } else if (arg == "-O3") {
+            level = OptLevel::O3;
+        } else if (arg == "--flat") {
+            flat = true;
+        } else if (arg == "--no-simplify") {
+            simplify = false;
+        } else if (arg == "--no-share") {
+            share = false;
+        } else if (arg == "--types") {
+            inferTypes = true;
+        } else if (arg == "--no-types") {
+            inferTypes = false;
+        } else if (arg == "--pipeline") {
+            pipeline = true;
+        } else if (arg.compare(0, 3, "-j=") == 0) {
+            threads = static_cast<unsigned>(atoi(arg.c_str() + 3));
+        } else if (arg.compare(0, 10, "--parse-j=") == 0) {
+            parseThreads = static_cast<unsigned>(atoi(arg.c_str() + 10));
+        } else if (arg.compare(0, 6, "--aot=") == 0) {
+            aotBase = arg.substr(6);
+        } else if (arg.compare(0, 6, "--cpu=") == 0) {
+            cpu = arg.substr(6);
+        } else if (arg.compare(0, 11, "--features=") == 0) {
+            features = arg.substr(11);
+        } else if (arg == "--tiered") {
+            tierThreshold = 1000;
+        } else if (arg.compare(0, 9, "--tiered=") == 0) {
+            tierThreshold = strtoull(arg.c_str() + 9, nullptr, 10);
+        } else if (arg == "--memoize") {
+            memoCapacity = 1 << 16;
+        } else if (arg.compare(0, 10, "--memoize=") == 0) {
+            memoCapacity = static_cast<size_t>(strtoull(arg.c_str() + 10, nullptr, 10));
+        } else if (arg.compare(0, 8, "--cache=") == 0) {
+            cacheDir = arg.substr(8);
+        } else if (arg.compare(0, 13, "--cache-size=") == 0) {
+            cacheBytes = static_cast<size_t>(atol(arg.c_str() + 13)) << 20;
+        } else if (arg == "--stats") {
+            printStats = true;
+        } else if (arg == "--stats-json") {
+            printJSON = true;
+        } else if (arg[0] != '-' && path.empty()) {
+            path = arg;
+        } else {
+            cout << "Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    // the FlatAST only emits plain code, these modes emit from the tree
+    if (flat && (inferTypes || memoCapacity != 0 || tierThreshold != 0)) {
+        cout << "--flat can't be combined with --types, --memoize or --tiered" << endl;
+        return 1;
+    }
+
     string src = R"CODE(
 6  * 7.777 - 8.8
 extern sin(x)
@@ -31,19 +100,112 @@ def foo(x y)
 sin(0)
     
 def test(x) (1+2+x) * (x + (1+2))
+
+# Compute the x'th fibonacci number.
+def fib(x)
+  if x < 3 then
+    1
+  else
+    fib(x - 1) + fib(x - 2)
+
+fib(10)
 )CODE";
 
 //    string src = "def test(x) (123+2+x) * (x + (123+2))";
 
-    shared_ptr<Lexer> lexer = make_shared<StringLexer>(src);
+    shared_ptr<Lexer> lexer;
+    if (path.empty()) {
+        lexer = make_shared<StringLexer>(src);
+    } else {
+        auto fileLexer = make_shared<MMapLexer>(path);
+        if (!fileLexer->IsOpen()) {
+            return 1;
+        }
+        lexer = fileLexer;
+    }
 //    Token token = lexer->NextToken();
 //    while (token != Token::Eof) {
 //        cout << token << endl;
 //        token = lexer->NextToken();
 //    }
     
-    ASTGenerator astgen(lexer);
+    Stats stats;
+    unique_ptr<DiskObjectCache> cache;
+    if (!cacheDir.empty()) {
+        cache = make_unique<DiskObjectCache>(cacheDir, cacheBytes);
+    }
+    ASTGenerator astgen(lexer, level);
+    astgen.UseFlatAST(flat);
+    astgen.UsePipeline(pipeline);
+    astgen.UseHashConsing(share);
+    astgen.UseParallelCodeGen(threads);
+    astgen.UseParallelParse(parseThreads);
+    astgen.SetObjectCache(cache.get());
+    astgen.UseTiering(tierThreshold);
+    astgen.UseMemoization(memoCapacity);
+    astgen.UseTypeInference(inferTypes);
+    if (printStats || printJSON) {
+        astgen.SetStats(&stats);
+    }
     astgen.Run();
+    if (simplify) {
+        astgen.Simplify();
+    }
     astgen.PrintAST();
-    astgen.CodeGen();
+    if (!aotBase.empty()) {
+        // BASE.o, BASE.a, BASE.bc, BASE.ll and BASE.h instead of running
+        auto aot = AOTCompiler::Create(cpu, features);
+        if (!aot) {
+            return 1;
+        }
+        AOTModule result = astgen.CodeGenModule(*aot);
+        if (!aot->EmitObject(*result.module, aotBase + ".o") ||
+            !aot->EmitLibrary(aotBase + ".o", aotBase + ".a") ||
+            !aot->EmitBitcode(*result.module, aotBase + ".bc") ||
+            !aot->EmitIR(*result.module, aotBase + ".ll") ||
+            !AOTCompiler::EmitHeader(*result.module, aotBase + ".h")) {
+            return 1;
+        }
+        cout << "Compiled for " << aot->GetTargetTriple().str() << " " << aot->GetCPU() << endl;
+    } else {
+        for (double result: astgen.CodeGen()) {
+            cout << "Evaluated to " << result << endl;
+        }
+    }
+    if (simplify) {
+        cout << astgen.GetSimplifier().GetString() << endl;
+    }
+    cout << astgen.GetOptimizer().GetString() << endl;
+    if (printStats) {
+        cout << stats.GetString();
+        if (cache) {
+            cout << cache->GetString() << endl;
+        }
+        if (astgen.GetTiering()) {
+            cout << astgen.GetTiering()->GetString() << endl;
+        }
+        if (memoCapacity) {
+            cout << "Memoization: " << astgen.GetPurity().GetPureCount() << " pure definitions" << endl;
+            for (auto *table: astgen.GetMemoTables()) {
+                cout << "  " << table->GetString() << endl;
+            }
+        }
+    }
+    if (printJSON) {
+        if (cache) {
+            stats.AddSection("cache", cache->GetJSON());
+        }
+        if (astgen.GetTiering()) {
+            stats.AddSection("tiering", astgen.GetTiering()->GetJSON());
+        }
+        if (memoCapacity) {
+            string tables;
+            for (auto *table: astgen.GetMemoTables()) {
+                tables += (tables.empty() ? "" : ", ") + table->GetJSON();
+            }
+            stats.AddSection("memoization", "{\"pure_definitions\": " + to_string(astgen.GetPurity().GetPureCount()) +
+                             ", \"tables\": [" + tables + "]}");
+        }
+        cout << stats.GetJSON() << endl;
+    }
 }